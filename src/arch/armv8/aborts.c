@@ -20,6 +20,9 @@
 #include <emul.h>
 #include <arch/psci.h>
 #include <hypercall.h>
+#include <balloon.h>
+#include <stats.h>
+#include <trace.h>
 
 typedef void (*abort_handler_t)(uint32_t, uint64_t, uint64_t);
 
@@ -35,15 +38,61 @@ void internal_abort_handler(uint64_t gprs[]) {
     ERROR("cpu%d internal hypervisor abort - PANIC\n", cpu.id);
 }
 
-void aborts_data_lower(uint32_t iss, uint64_t far, uint64_t il)
+/* Offsets of the synchronous exception vectors from VBAR_EL1 */
+#define VBAR_SYNC_CUR_SP0 (0x000)
+#define VBAR_SYNC_CUR_SPX (0x200)
+#define VBAR_SYNC_LOWER64 (0x400)
+
+/**
+ * Reflects the current guest abort back to the guest as a synchronous
+ * external abort, taken to its EL1 vector as if no memory was there. ec is
+ * the class of the abort as taken from EL0, i.e., ESR_EC_DALEL or
+ * ESR_EC_IALEL. Only AArch64 guests are supported.
+ */
+static void aborts_inject_guest(uint64_t ec, uint32_t iss, uint64_t il)
 {
-    if (!(iss & ESR_ISS_DA_ISV_BIT) || (iss & ESR_ISS_DA_FnV_BIT)) {
-        ERROR("no information to handle data abort (0x%x)", far);
+    uint64_t spsr = cpu.vcpu->regs->spsr_el2;
+    uint64_t offset = VBAR_SYNC_LOWER64;
+
+    if ((spsr & SPSR_EL_MSK) != SPSR_EL0t) {
+        /* the same ec but taken from the current el */
+        ec += 1;
+        offset = ((spsr & SPSR_EL_MSK) == SPSR_EL1h) ? VBAR_SYNC_CUR_SPX
+                                                     : VBAR_SYNC_CUR_SP0;
     }
 
+    uint64_t esr = (ec << ESR_EC_OFF) | (il << ESR_IL_OFF) |
+                   (iss & ESR_ISS_DA_WnR_BIT) | ESR_ISS_DA_DSFC_SYNCEXT;
+
+    MSR(ESR_EL1, esr);
+    MSR(FAR_EL1, MRS(FAR_EL2));
+    MSR(ELR_EL1, cpu.vcpu->regs->elr_el2);
+    MSR(SPSR_EL1, spsr);
+
+    cpu.vcpu->regs->spsr_el2 = SPSR_EL1h | SPSR_F | SPSR_I | SPSR_A | SPSR_D;
+    cpu.vcpu->regs->elr_el2 = MRS(VBAR_EL1) + offset;
+}
+
+void aborts_data_lower(uint32_t iss, uint64_t far, uint64_t il)
+{
     uint32_t DSFC =
         bit_extract(iss, ESR_ISS_DA_DSFC_OFF, ESR_ISS_DA_DSFC_LEN) & (0xf << 2);
 
+    /**
+     * Faults on the vm's own memory are not emulated. Either the access is
+     * replayed on the now mapped page, or the guest gets an abort.
+     */
+    if (DSFC == ESR_ISS_DA_DSFC_TRNSLT && vm_mem_is_ram(cpu.vcpu->vm, far)) {
+        if (!vm_mem_populate(cpu.vcpu->vm, far)) {
+            aborts_inject_guest(ESR_EC_DALEL, iss, il);
+        }
+        return;
+    }
+
+    if (!(iss & ESR_ISS_DA_ISV_BIT) || (iss & ESR_ISS_DA_FnV_BIT)) {
+        ERROR("no information to handle data abort (0x%x)", far);
+    }
+
     if (DSFC != ESR_ISS_DA_DSFC_TRNSLT) {
         ERROR("data abort is not translation fault - cant deal with it");
     }
@@ -77,6 +126,21 @@ void aborts_data_lower(uint32_t iss, uint64_t far, uint64_t il)
     }
 }
 
+void aborts_inst_lower(uint32_t iss, uint64_t far, uint64_t il)
+{
+    uint32_t IFSC =
+        bit_extract(iss, ESR_ISS_IA_IFSC_OFF, ESR_ISS_IA_IFSC_LEN) & (0xf << 2);
+
+    if (IFSC != ESR_ISS_DA_DSFC_TRNSLT || !vm_mem_is_ram(cpu.vcpu->vm, far)) {
+        ERROR("no handler for instruction abort (0x%x at 0x%x)", far,
+              cpu.vcpu->regs->elr_el2);
+    }
+
+    if (!vm_mem_populate(cpu.vcpu->vm, far)) {
+        aborts_inject_guest(ESR_EC_IALEL, 0, il);
+    }
+}
+
 void smc64_handler(uint32_t iss, uint64_t far, uint64_t il)
 {
     uint64_t smc_fid = cpu.vcpu->regs->x[0];
@@ -105,10 +169,17 @@ void hvc64_handler(uint32_t iss, uint64_t far, uint64_t il)
     uint64_t x3 = cpu.vcpu->regs->x[3];
 
     int64_t ret = -HC_E_INVAL_ID;
+    stats_hypercall_exit(hvc_fid);
     switch(hvc_fid){
         case HC_IPC:
             ret = ipc_hypercall(x1, x2, x3);
         break;
+        case HC_BALLOON:
+            ret = balloon_hypercall(x1, x2, x3);
+        break;
+        case HC_STATS:
+            ret = stats_hypercall(x1, x2, x3);
+        break;
     }
 
     vcpu_writereg(cpu.vcpu, 0, ret);
@@ -140,12 +211,14 @@ void sysreg_handler(uint32_t iss, uint64_t far, uint64_t il)
 }
 
 abort_handler_t abort_handlers[64] = {[ESR_EC_DALEL] = aborts_data_lower,
+                                      [ESR_EC_IALEL] = aborts_inst_lower,
                                       [ESR_EC_SMC64] = smc64_handler,
                                       [ESR_EC_SYSRG] = sysreg_handler,
                                       [ESR_EC_HVC64] = hvc64_handler};
 
 void aborts_sync_handler()
 {
+    uint64_t start = stats_timestamp();
     uint32_t esr = MRS(ESR_EL2);
     uint64_t far = MRS(FAR_EL2);
     uint64_t hpfar = MRS(HPFAR_EL2);
@@ -157,9 +230,14 @@ void aborts_sync_handler()
     uint32_t il = bit_extract(esr, ESR_IL_OFF, ESR_IL_LEN);
     uint32_t iss = bit_extract(esr, ESR_ISS_OFF, ESR_ISS_LEN);
 
+    TRACE(TRACE_VM_EXIT, TRACE_EXIT_SYNC, esr);
+
     abort_handler_t handler = abort_handlers[ec];
     if (handler)
         handler(iss, ipa_fault_addr, il);
     else
         ERROR("no handler for abort ec = 0x%x", ec);  // unknown guest exception
+
+    stats_sync_exit(ec, start);
+    TRACE(TRACE_VM_ENTRY, 0, 0);
 }
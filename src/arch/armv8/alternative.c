@@ -0,0 +1,65 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#include <alternative.h>
+#include <arch/sysregs.h>
+#include <fences.h>
+#include <bit.h>
+
+uint64_t alternatives_arch_detect()
+{
+    uint64_t features = 0;
+    uint64_t isar0 = MRS(ID_AA64ISAR0_EL1);
+
+    if (bit_extract(isar0, ID_AA64ISAR0_ATOMIC_OFF, ID_AA64ISAR0_ATOMIC_LEN) >=
+        ID_AA64ISAR0_ATOMIC_LSE) {
+        features |= 1ULL << ARCH_FEAT_LSE;
+    }
+
+    if (bit_extract(isar0, ID_AA64ISAR0_TLB_OFF, ID_AA64ISAR0_TLB_LEN) >=
+        ID_AA64ISAR0_TLB_RANGE) {
+        features |= 1ULL << ARCH_FEAT_TLB_RANGE;
+    }
+
+    return features;
+}
+
+/**
+ * Clean the patched code to the point of unification and invalidate it from
+ * all instruction caches.
+ */
+void alternatives_arch_sync(void *addr, size_t size)
+{
+    uint64_t ctr = MRS(CTR_EL0);
+    uint64_t dline = 4 << bit_extract(ctr, CTR_DMINLINE_OFF, CTR_DMINLINE_LEN);
+    uint64_t iline = 4 << bit_extract(ctr, CTR_IMINLINE_OFF, CTR_IMINLINE_LEN);
+    uint64_t start = (uint64_t)addr;
+    uint64_t end = start + size;
+
+    for (uint64_t va = start & ~(dline - 1); va < end; va += dline) {
+        asm volatile("dc cvau, %0\n\t" ::"r"(va) : "memory");
+    }
+    DSB(ish);
+
+    for (uint64_t va = start & ~(iline - 1); va < end; va += iline) {
+        asm volatile("ic ivau, %0\n\t" ::"r"(va) : "memory");
+    }
+    DSB(ish);
+}
+
+void alternatives_arch_sync_local()
+{
+    ISB();
+}
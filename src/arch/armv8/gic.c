@@ -18,6 +18,7 @@
 #include <cpu.h>
 #include <spinlock.h>
 #include <platform.h>
+#include <trace.h>
 
 volatile gicd_t gicd __attribute__((section(".devices"), aligned(PAGE_SIZE)));
 spinlock_t gicd_lock;
@@ -95,11 +96,15 @@ void gic_handle()
     uint64_t ack = gicc_iar();
     uint64_t id = bit_extract(ack, GICC_IAR_ID_OFF, GICC_IAR_ID_LEN);
 
+    TRACE(TRACE_VM_EXIT, TRACE_EXIT_IRQ, id);
+
     if (id < GIC_FIRST_SPECIAL_INTID) {
         enum irq_res res = interrupts_handle(id);
         gicc_eoir(ack);
         if (res == HANDLED_BY_HYP) gicc_dir(ack);
     }
+
+    TRACE(TRACE_VM_ENTRY, 0, 0);
 }
 
 uint64_t gicd_get_prio(uint64_t int_id)
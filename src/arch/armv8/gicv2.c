@@ -201,6 +201,24 @@ void gic_send_sgi(uint64_t cpu_target, uint64_t sgi_num)
     }
 }
 
+void gic_send_sgi_mask(uint64_t cpu_mask, uint64_t sgi_num)
+{
+    uint64_t trglst = 0;
+
+    if (sgi_num >= GIC_MAX_SGIS) return;
+
+    for (size_t i = 0; i < GIC_MAX_TARGETS; i++) {
+        if (cpu_mask & (1ULL << i)) {
+            trglst |= 1UL << gic_cpu_map[i];
+        }
+    }
+
+    if (trglst != 0) {
+        gicd.SGIR = (trglst << GICD_SGIR_CPUTRGLST_OFF) |
+                    (sgi_num & GICD_SGIR_SGIINTID_MSK);
+    }
+}
+
 static inline uint8_t gic_translate_cpu_to_trgt(uint8_t cpu_targets) {
     uint8_t gic_targets = 0;
     for(int i = 0; i < GIC_MAX_TARGETS; i++) {
@@ -338,6 +338,33 @@ void gic_send_sgi(uint64_t cpu_target, uint64_t sgi_num)
     }
 }
 
+void gic_send_sgi_mask(uint64_t cpu_mask, uint64_t sgi_num)
+{
+    if (sgi_num >= GIC_MAX_SGIS) return;
+
+    /**
+     * A single write reaches all targets sharing the same Aff1, so group
+     * them by cluster.
+     */
+    while (cpu_mask != 0) {
+        uint64_t aff1 = 0;
+        uint64_t trglst = 0;
+        for (size_t i = 0; i < platform.cpu_num; i++) {
+            if (!(cpu_mask & (1ULL << i))) continue;
+            uint64_t mpidr = cpu_id_to_mpidr(i) & MPIDR_AFF_MSK;
+            if (trglst == 0) aff1 = MPIDR_AFF_LVL(mpidr, 1);
+            if (MPIDR_AFF_LVL(mpidr, 1) == aff1) {
+                trglst |= 1UL << MPIDR_AFF_LVL(mpidr, 0);
+                cpu_mask &= ~(1ULL << i);
+            }
+        }
+        if (trglst == 0) break;
+
+        MSR(ICC_SGI1R_EL1, (aff1 << ICC_SGIR_AFF1_OFFSET) | trglst |
+                               (sgi_num << ICC_SGIR_SGIINTID_OFF));
+    }
+}
+
 void gic_set_prio(uint64_t int_id, uint8_t prio)
 {
     if (!gic_is_priv(int_id)) {
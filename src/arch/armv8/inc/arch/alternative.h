@@ -0,0 +1,49 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#ifndef __ARCH_ALTERNATIVE_H__
+#define __ARCH_ALTERNATIVE_H__
+
+#include <bao.h>
+
+/* Optional cpu features patched in at boot */
+#define ARCH_FEAT_LSE (0)       /* ARMv8.1 large system extension atomics */
+#define ARCH_FEAT_TLB_RANGE (1) /* ARMv8.4 TLBI range operations */
+
+/**
+ * Emits orig and records it in .alternatives, to be overwritten by repl at
+ * boot if the cpu has feature feat. Both must have the same size, padded
+ * with nops as needed, and repl must not branch out of itself. The lse
+ * extension is enabled in the assembler for the replacements.
+ */
+#define ALTERNATIVE(orig, repl, feat)                               \
+    "661:\n\t" orig "\n"                                            \
+    "662:\n\t"                                                      \
+    ".pushsection .alternatives, \"a\"\n\t"                         \
+    ".balign 8\n\t"                                                 \
+    ".8byte 661b, 663f\n\t"                                         \
+    ".2byte " XSTR(feat) "\n\t"                                     \
+    ".byte 662b - 661b, 664f - 663f\n\t"                            \
+    ".4byte 0\n\t"                                                  \
+    ".popsection\n\t"                                               \
+    ".pushsection .altinstr_replacement, \"ax\"\n\t"                \
+    ".arch_extension lse\n\t"                                       \
+    "663:\n\t" repl "\n"                                            \
+    "664:\n\t"                                                      \
+    ".popsection\n\t"                                               \
+    ".org . - (664b - 663b) + (662b - 661b)\n\t"                    \
+    ".org . - (662b - 661b) + (664b - 663b)\n\t"
+
+#endif /* __ARCH_ALTERNATIVE_H__ */
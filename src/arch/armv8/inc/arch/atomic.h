@@ -0,0 +1,141 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#ifndef __ARCH_ATOMIC_H__
+#define __ARCH_ATOMIC_H__
+
+#include <bao.h>
+#include <alternative.h>
+
+/**
+ * The atomics below use LL/SC loops, replaced at boot by the equivalent LSE
+ * instructions if the cpus support them. All have acquire and release
+ * semantics.
+ */
+
+/**
+ * Atomically replaces *ptr by new if it still holds old. Returns true on
+ * success.
+ */
+static inline bool atomic_cas64(volatile uint64_t* ptr, uint64_t old,
+                                uint64_t new)
+{
+    uint64_t tmp;
+    uint32_t fail;
+
+    asm volatile(ALTERNATIVE(
+                     "1:\n\t"
+                     "ldaxr %0, %2 \n\t"
+                     "cmp %0, %3 \n\t"
+                     "b.ne 2f \n\t"
+                     "stlxr %w1, %4, %2 \n\t"
+                     "cbnz %w1, 1b \n\t"
+                     "2:",
+                     "mov %0, %3 \n\t"
+                     "casal %0, %4, %2 \n\t"
+                     "nop \n\t"
+                     "nop \n\t"
+                     "nop",
+                     ARCH_FEAT_LSE)
+                 : "=&r"(tmp), "=&r"(fail), "+Q"(*ptr)
+                 : "r"(old), "r"(new)
+                 : "cc", "memory");
+
+    return tmp == old;
+}
+
+/**
+ * Atomically adds val to *ptr and returns the resulting value.
+ */
+static inline uint64_t atomic_add64(volatile uint64_t* ptr, uint64_t val)
+{
+    uint64_t old, new;
+    uint32_t fail;
+
+    asm volatile(ALTERNATIVE(
+                     "1:\n\t"
+                     "ldaxr %0, %3 \n\t"
+                     "add %1, %0, %4 \n\t"
+                     "stlxr %w2, %1, %3 \n\t"
+                     "cbnz %w2, 1b",
+                     "ldaddal %4, %0, %3 \n\t"
+                     "add %1, %0, %4 \n\t"
+                     "nop \n\t"
+                     "nop",
+                     ARCH_FEAT_LSE)
+                 : "=&r"(old), "=&r"(new), "=&r"(fail), "+Q"(*ptr)
+                 : "r"(val)
+                 : "memory");
+
+    return new;
+}
+
+/**
+ * Atomically replaces *ptr by val and returns its previous value.
+ */
+static inline uint64_t atomic_swap64(volatile uint64_t* ptr, uint64_t val)
+{
+    uint64_t old;
+    uint32_t fail;
+
+    asm volatile(ALTERNATIVE(
+                     "1:\n\t"
+                     "ldaxr %0, %2 \n\t"
+                     "stlxr %w1, %3, %2 \n\t"
+                     "cbnz %w1, 1b",
+                     "swpal %3, %0, %2 \n\t"
+                     "nop \n\t"
+                     "nop",
+                     ARCH_FEAT_LSE)
+                 : "=&r"(old), "=&r"(fail), "+Q"(*ptr)
+                 : "r"(val)
+                 : "memory");
+
+    return old;
+}
+
+/**
+ * Waits in low power until *ptr no longer holds val. The exclusive load arms
+ * the monitor, so a write to *ptr by another cpu also ends the wfe. Has
+ * acquire semantics.
+ */
+static inline void atomic_wait_ne64(volatile uint64_t* ptr, uint64_t val)
+{
+    uint64_t tmp;
+
+    asm volatile(
+        "sevl \n\t"
+        "1:\n\t"
+        "wfe \n\t"
+        "ldaxr %0, %1 \n\t"
+        "cmp %0, %2 \n\t"
+        "b.eq 1b \n\t"
+        : "=&r"(tmp)
+        : "Q"(*ptr), "r"(val)
+        : "cc", "memory");
+}
+
+/**
+ * Wakes up the cpus waiting in atomic_wait_ne64, after the preceding writes
+ * completed.
+ */
+static inline void atomic_wake()
+{
+    asm volatile(
+        "dsb ish \n\t"
+        "sev \n\t" ::: "memory");
+}
+
+#endif /* __ARCH_ATOMIC_H__ */
@@ -413,6 +413,7 @@ extern uint64_t NUM_LRS;
 void gic_init();
 void gic_cpu_init();
 void gic_send_sgi(uint64_t cpu_target, uint64_t sgi_num);
+void gic_send_sgi_mask(uint64_t cpu_mask, uint64_t sgi_num);
 
 void gicc_save_state(gicc_state_t *state);
 void gicc_restore_state(gicc_state_t *state);
@@ -130,6 +130,13 @@
 #define PTE_VM_DEV_FLAGS \
     (PTE_MEMATTR_DEV_GRE | PTE_SH_NS | PTE_S2AP_RW | PTE_AF)
 
+/**
+ * The contiguous hint marks runs of this many aligned entries mapping
+ * contiguous physical memory with the same attributes.
+ */
+#define PTE_CONTIG_NUM (16)
+#define PTE_CONTIG PTE_Con
+
 #ifndef __ASSEMBLER__
 
     typedef uint64_t pte_t;
@@ -13,38 +13,70 @@
  *
  */
 
-/**
- * TODO: this is a naive implementation to get things going.
- * Optimizations needed. See ticket locks in ARMv8-A.
- */
-
 #ifndef __ARCH_SPINLOCK__
 #define __ARCH_SPINLOCK__
 
 #include <bao.h>
+#include <alternative.h>
 
+/**
+ * Ticket lock. The low half is the ticket being served (owner) and the high
+ * half is the next ticket to hand out.
+ */
 typedef volatile uint32_t spinlock_t;
 
 #define SPINLOCK_INITVAL (0)
+#define SPINLOCK_NEXT_SHIFT (16)
+#define SPINLOCK_OWNER_MSK (0xffff)
 
 static inline void spin_lock(spinlock_t* lock)
 {
-    uint32_t const ONE = 1;
-    spinlock_t tmp;
+    uint32_t const INC = 1 << SPINLOCK_NEXT_SHIFT;
+    uint32_t tmp, cmp, owner;
 
     asm volatile(
-        "1:\n\t"
-        "ldaxr %w0, %1 \n\t"
-        "cbnz %w0, 1b \n\t"
-        "stxr %w0, %w2, %1 \n\t"
-        "cbnz %w0, 1b \n\t"
-        : "=&r"(tmp), "+Q"(*lock)
-        : "r"(ONE));
+        /* Take a ticket, with a single ldadda if LSE is available */
+        ALTERNATIVE(
+            "1:\n\t"
+            "ldaxr %w0, %3 \n\t"
+            "add %w1, %w0, %w5 \n\t"
+            "stxr %w2, %w1, %3 \n\t"
+            "cbnz %w2, 1b",
+            "ldadda %w5, %w0, %3 \n\t"
+            "nop \n\t"
+            "nop \n\t"
+            "nop",
+            ARCH_FEAT_LSE)
+        /* Done if it is already being served */
+        "eor %w1, %w0, %w0, ror #16 \n\t"
+        "cbz %w1, 3f \n\t"
+        /**
+         * Wait for the owner to reach it. The release store of the owner
+         * clears the exclusive monitor armed by ldaxrh, ending the wfe.
+         */
+        "sevl \n\t"
+        "2:\n\t"
+        "wfe \n\t"
+        "ldaxrh %w2, %4 \n\t"
+        "eor %w1, %w2, %w0, lsr #16 \n\t"
+        "cbnz %w1, 2b \n\t"
+        "3:\n\t"
+        : "=&r"(tmp), "=&r"(cmp), "=&r"(owner), "+Q"(*lock)
+        : "Q"(*(volatile uint16_t*)lock), "r"(INC)
+        : "memory");
 }
 
 static inline void spin_unlock(spinlock_t* lock)
 {
-    asm volatile("stlr wzr, %0\n\t" ::"Q"(*lock));
+    uint32_t tmp;
+
+    asm volatile(
+        "ldrh %w0, %1 \n\t"
+        "add %w0, %w0, #1 \n\t"
+        "stlrh %w0, %1 \n\t"
+        : "=&r"(tmp), "+Q"(*(volatile uint16_t*)lock)
+        :
+        : "memory");
 }
 
-#endif /* __ARCH_SPINLOCK__ */
\ No newline at end of file
+#endif /* __ARCH_SPINLOCK__ */
@@ -25,6 +25,14 @@
 #define ID_AA64MMFR0_PAR_MSK \
     BIT_MASK(ID_AA64MMFR0_PAR_OFF, ID_AA64MMFR0_PAR_LEN)
 
+/* ID_AA64ISAR0_EL1, AArch64 Instruction Set Attribute Register 0 */
+#define ID_AA64ISAR0_ATOMIC_OFF 20
+#define ID_AA64ISAR0_ATOMIC_LEN 4
+#define ID_AA64ISAR0_ATOMIC_LSE (2)
+#define ID_AA64ISAR0_TLB_OFF 56
+#define ID_AA64ISAR0_TLB_LEN 4
+#define ID_AA64ISAR0_TLB_RANGE (2)
+
 #define SPSel_SP (1 << 0)
 
 /* PSTATE */
@@ -354,6 +362,8 @@
 
 #define ESR_ISS_DA_DSFC_OFF (0)
 #define ESR_ISS_DA_DSFC_LEN (6)
+#define ESR_ISS_IA_IFSC_OFF (0)
+#define ESR_ISS_IA_IFSC_LEN (6)
 #define ESR_ISS_DA_WnR_OFF (6)
 #define ESR_ISS_DA_WnR_LEN (1)
 #define ESR_ISS_DA_WnR_BIT (1 << 6)
@@ -387,6 +397,7 @@
 #define ESR_ISS_DA_DSFC_TRNSLT (0x4)
 #define ESR_ISS_DA_DSFC_ACCESS (0x8)
 #define ESR_ISS_DA_DSFC_PERMIS (0xC)
+#define ESR_ISS_DA_DSFC_SYNCEXT (0x10)
 
 #define ESR_ISS_SYSREG_ADDR ((0xfff << 10) | (0xf << 1))
 #define ESR_ISS_SYSREG_DIR (0x1)
@@ -13,26 +13,22 @@
  *
  */
 
-#include <bit.h>
+#ifndef __ARCH_TIMER_H__
+#define __ARCH_TIMER_H__
 
-size_t bit_ctz(uint64_t n)
-{
-    int i = 0;
-
-    for (i = 0; i < sizeof(n) * 8; i++) {
-        if ((n >> i) & 0x1) return i;
-    }
+#include <bao.h>
+#include <arch/sysregs.h>
+#include <arch/fences.h>
 
-    return i;
+static inline uint64_t timer_arch_get()
+{
+    ISB();
+    return MRS(CNTPCT_EL0);
 }
 
-size_t bit_clz(uint64_t n)
+static inline uint64_t timer_arch_freq()
 {
-    int i = 0, j;
-
-    for (i = (sizeof(n) * 8) - 1, j = 0; i >= 0; i--, j++) {
-        if ((n >> i) & 0x1) return j;
-    }
+    return MRS(CNTFRQ_EL0);
+}
 
-    return j;
-}
\ No newline at end of file
+#endif /* __ARCH_TIMER_H__ */
@@ -19,6 +19,7 @@
 #include <bao.h>
 #include <arch/sysregs.h>
 #include <arch/fences.h>
+#include <alternative.h>
 
 static inline void tlb_hyp_inv_va(void* va)
 {
@@ -38,46 +39,131 @@ static inline void tlb_hyp_inv_all()
         "isb\n\t");
 }
 
-static inline void tlb_vm_inv_va(uint64_t vmid, void* va)
+/**
+ * Above these many pages, invalidating a whole range costs more than
+ * invalidating every entry of the VMID (or the hypervisor).
+ */
+#define TLB_INV_MAX_PAGES (512)
+#define TLB_INV_RANGE_MAX_PAGES (32UL << 16)
+
+/**
+ * TLB maintenance by IPA only applies to the current VMID, so temporarily
+ * switch to the target VMID if needed, keeping the translation table base.
+ */
+static inline uint64_t tlb_vm_switch_vmid(uint64_t vmid)
 {
-    uint64_t vttbr = 0;
-    vttbr = MRS(VTTBR_EL2);
-    bool switch_vmid =
-        bit_extract(vttbr, VTTBR_VMID_OFF, VTTBR_VMID_LEN) != vmid;
-
-    if (switch_vmid) {
-        MSR(VTTBR_EL2, ((vmid << VTTBR_VMID_OFF) & VTTBR_VMID_MSK));
-        DSB(ish);
+    uint64_t vttbr = MRS(VTTBR_EL2);
+
+    if (bit_extract(vttbr, VTTBR_VMID_OFF, VTTBR_VMID_LEN) != vmid) {
+        MSR(VTTBR_EL2, (vttbr & ~VTTBR_VMID_MSK) |
+                           ((vmid << VTTBR_VMID_OFF) & VTTBR_VMID_MSK));
         ISB();
     }
 
-    asm volatile("tlbi ipas2e1is, %0\n\t" ::"r"(((uint64_t)va) >> 12));
+    return vttbr;
+}
 
-    if (switch_vmid) {
-        DSB(ish);
-        MSR(VTTBR_EL2, ((vmid << VTTBR_VMID_OFF) & VTTBR_VMID_MSK));
+static inline void tlb_vm_restore_vmid(uint64_t vttbr)
+{
+    if (MRS(VTTBR_EL2) != vttbr) {
+        MSR(VTTBR_EL2, vttbr);
+        ISB();
     }
 }
 
+/* ARMv8.4-TLBI range instructions */
+static inline bool tlb_has_range()
+{
+    return cpu_has_feature(ARCH_FEAT_TLB_RANGE);
+}
+
+static inline void tlb_vm_inv_va(uint64_t vmid, void* va)
+{
+    uint64_t vttbr = tlb_vm_switch_vmid(vmid);
+
+    DSB(ishst);
+    asm volatile("tlbi ipas2e1is, %0\n\t" ::"r"(((uint64_t)va) >> 12));
+    DSB(ish);
+
+    tlb_vm_restore_vmid(vttbr);
+}
+
 static inline void tlb_vm_inv_all(uint64_t vmid)
 {
-    uint64_t vttbr = 0;
-    vttbr = MRS(VTTBR_EL2);
-    bool switch_vmid =
-        bit_extract(vttbr, VTTBR_VMID_OFF, VTTBR_VMID_LEN) != vmid;
-
-    if (switch_vmid) {
-        MSR(VTTBR_EL2, ((vmid << VTTBR_VMID_OFF) & VTTBR_VMID_MSK));
-        DSB(ish);
-        ISB();
-    }
+    uint64_t vttbr = tlb_vm_switch_vmid(vmid);
 
+    DSB(ishst);
     asm volatile("tlbi vmalls12e1is\n\t");
+    DSB(ish);
+
+    tlb_vm_restore_vmid(vttbr);
+}
+
+/**
+ * Invalidate the stage 2 entries of a range of IPAs. With range support, the
+ * range is covered by the fewest RIPAS2E1IS operations, each invalidating
+ * (NUM + 1) << (5 * SCALE + 1) pages, plus a single page operation for odd
+ * page counts. The encoding is used directly since the assembler might not
+ * support ARMv8.4. Stage 1 entries, which may combine both stages, are then
+ * invalidated as a whole.
+ */
+static inline void tlb_vm_inv_range(uint64_t vmid, void* va, size_t size)
+{
+    uint64_t addr = ((uint64_t)va) >> 12;
+    size_t pages = ALIGN(size, PAGE_SIZE) / PAGE_SIZE;
+    bool range = tlb_has_range();
+
+    if ((!range && (pages > TLB_INV_MAX_PAGES)) ||
+        (range && (pages >= TLB_INV_RANGE_MAX_PAGES))) {
+        tlb_vm_inv_all(vmid);
+        return;
+    }
+
+    uint64_t vttbr = tlb_vm_switch_vmid(vmid);
+
+    DSB(ishst);
+    for (size_t scale = 0; pages > 0;) {
+        if (!range || (pages % 2)) {
+            asm volatile("tlbi ipas2e1is, %0\n\t" ::"r"(addr));
+            addr += 1;
+            pages -= 1;
+            continue;
+        }
+
+        int64_t num = ((pages >> ((5 * scale) + 1)) & 0x1f) - 1;
+        if (num >= 0) {
+            uint64_t op = (1UL << 46) | (scale << 44) | ((uint64_t)num << 39) |
+                          (addr & BIT_MASK(0, 37));
+            /* tlbi ripas2e1is, op */
+            asm volatile("sys #4, c8, c0, #2, %0\n\t" ::"r"(op));
+            addr += (num + 1) << ((5 * scale) + 1);
+            pages -= (num + 1) << ((5 * scale) + 1);
+        }
+        scale++;
+    }
+    DSB(ish);
+    asm volatile("tlbi vmalle1is\n\t");
+    DSB(ish);
+
+    tlb_vm_restore_vmid(vttbr);
+}
+
+static inline void tlb_hyp_inv_range(void* va, size_t size)
+{
+    uint64_t addr = ((uint64_t)va) >> 12;
+    size_t pages = ALIGN(size, PAGE_SIZE) / PAGE_SIZE;
+
+    if (pages > TLB_INV_MAX_PAGES) {
+        tlb_hyp_inv_all();
+        return;
+    }
 
-    if (switch_vmid) {
-        DSB(ish);
-        MSR(VTTBR_EL2, ((vmid << VTTBR_VMID_OFF) & VTTBR_VMID_MSK));
+    DSB(ish);
+    while (pages-- > 0) {
+        asm volatile("tlbi vae2is, %0\n\t" ::"r"(addr++));
     }
+    DSB(ish);
+    ISB();
 }
 
 #endif /* __ARCH_TLB_H__ */
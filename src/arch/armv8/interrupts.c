@@ -46,6 +46,11 @@ void interrupts_arch_ipi_send(uint64_t target_cpu, uint64_t ipi_id)
     if (ipi_id < GIC_MAX_SGIS) gic_send_sgi(target_cpu, ipi_id);
 }
 
+void interrupts_arch_ipi_send_mask(uint64_t cpu_mask, uint64_t ipi_id)
+{
+    if (ipi_id < GIC_MAX_SGIS) gic_send_sgi_mask(cpu_mask, ipi_id);
+}
+
 /* 
     给定中断ID，使能单个中断 
 */
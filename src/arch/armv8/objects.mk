@@ -18,6 +18,7 @@ cpu-objs-y+=exceptions.o
 cpu-objs-y+=pagetables.o
 cpu-objs-y+=page_table.o
 cpu-objs-y+=cache.o
+cpu-objs-y+=string.o
 cpu-objs-y+=interrupts.o
 cpu-objs-y+=mem.o
 cpu-objs-y+=vmm.o
@@ -33,6 +34,7 @@ cpu-objs-y+=smmuv2.o
 cpu-objs-y+=gic.o
 cpu-objs-y+=vgic.o
 cpu-objs-y+=config.o
+cpu-objs-y+=alternative.o
 
 ifeq ($(GIC_VERSION), GICV2)
 	cpu-objs-y+=vgicv2.o
@@ -33,6 +33,9 @@ extern void psci_boot_entry(uint64_t x0);
 	SMC Trapping
 --------------------------------- */
 
+/* Max time cpu_on waits for the target cpu to wake up */
+#define PSCI_CPU_ON_TIMEOUT_US (1000)
+
 void psci_wake_from_off(){
   
     if(cpu.vcpu == NULL){
@@ -143,8 +146,13 @@ int64_t psci_cpu_on_handler(uint64_t target_cpu, uintptr_t entrypoint,
 
         uint64_t pcpuid = vm_translate_to_pcpuid(vm, target_vcpu->id);
 
+        /**
+         * Wait for the target to leave ON_PENDING, so that AFFINITY_INFO
+         * already reports it on. If it takes too long, the target still
+         * wakes up later on, as the request was accepted.
+         */
         cpu_msg_t msg = {PSCI_CPUSMG_ID, PSCI_MSG_ON};
-        cpu_send_msg(pcpuid, &msg);
+        cpu_call(1ULL << pcpuid, &msg, PSCI_CPU_ON_TIMEOUT_US);
 
         ret = PSCI_E_SUCCESS;
 
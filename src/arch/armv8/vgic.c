@@ -20,6 +20,7 @@
 #include <cpu.h>
 #include <interrupts.h>
 #include <vm.h>
+#include <trace.h>
 
 enum VGIC_EVENTS { VGIC_UPDATE_ENABLE, VGIC_ROUTE, VGIC_INJECT, VGIC_SET_REG };
 extern volatile const uint64_t VGIC_IPI_ID;
@@ -134,11 +135,7 @@ void vgic_send_sgi_msg(vcpu_t *vcpu, uint64_t pcpu_mask, uint64_t int_id)
         VGIC_IPI_ID, VGIC_INJECT,
         VGIC_MSG_DATA(cpu.vcpu->vm->id, 0, int_id, 0, cpu.vcpu->id)};
 
-    for (int i = 0; i < platform.cpu_num; i++) {
-        if (pcpu_mask & (1ull << i)) {
-            cpu_send_msg(i, &msg);
-        }
-    }
+    cpu_send_msg_mask(pcpu_mask, &msg);
 }
 
 void vgic_route(vcpu_t *vcpu, vgic_int_t *interrupt)
@@ -158,11 +155,7 @@ void vgic_route(vcpu_t *vcpu, vgic_int_t *interrupt)
         vgic_yield_ownership(vcpu, interrupt);
         uint64_t trgtlist =
             vgic_int_ptarget_mask(vcpu, interrupt) & ~(1ull << vcpu->phys_id);
-        for (int i = 0; i < platform.cpu_num; i++) {
-            if (trgtlist & (1ull << i)) {
-                cpu_send_msg(i, &msg);
-            }
-        }
+        cpu_send_msg_mask(trgtlist, &msg);
     }
 }
 
@@ -174,7 +167,7 @@ static inline void vgic_write_lr(vcpu_t *vcpu, vgic_int_t *interrupt,
     if ((prev_int_id != interrupt->id) && !gic_is_priv(prev_int_id)) {
         vgic_int_t *prev_interrupt = vgic_get_int(vcpu, prev_int_id, vcpu->id);
         if (prev_interrupt != NULL) {
-            spin_lock(&prev_interrupt->lock);
+            spin_lock_class(&prev_interrupt->lock, SPINLOCK_CLASS_VIRQ);
             if (vgic_owns(vcpu, prev_interrupt) && prev_interrupt->in_lr &&
                 (prev_interrupt->lr == lr_ind)) {
                 prev_interrupt->in_lr = false;
@@ -334,7 +327,8 @@ bool vgic_add_lr(vcpu_t *vcpu, vgic_int_t *interrupt)
 
             if (spilled_int != NULL) {
                 // TODO: possible deadlock?
-                spin_lock(&spilled_int->lock);
+                spin_lock_class(&spilled_int->lock, SPINLOCK_CLASS_VIRQ);
+                TRACE(TRACE_LR_SPILL, spilled_int->id, lr_ind);
                 vgic_remove_lr(vcpu, spilled_int);
                 vgic_yield_ownership(vcpu, spilled_int);
                 spin_unlock(&spilled_int->lock);
@@ -614,7 +608,7 @@ void vgic_emul_razwi(emul_access_t *acc, struct vgic_reg_handler_info *handlers,
 void vgic_int_set_field(struct vgic_reg_handler_info *handlers, vcpu_t *vcpu,
                         vgic_int_t *interrupt, uint64_t data)
 {
-    spin_lock(&interrupt->lock);
+    spin_lock_class(&interrupt->lock, SPINLOCK_CLASS_VIRQ);
     if (vgic_get_ownership(vcpu, interrupt)) {
         vgic_remove_lr(vcpu, interrupt);
         if (handlers->update_field(vcpu, interrupt, data) &&
@@ -862,7 +856,7 @@ bool vgicd_emul_handler(emul_access_t *acc)
     }
 
     if (vgic_check_reg_alignment(acc, handler_info)) {
-        spin_lock(&cpu.vcpu->vm->arch.vgicd.lock);
+        spin_lock_class(&cpu.vcpu->vm->arch.vgicd.lock, SPINLOCK_CLASS_VIRQ);
         handler_info->reg_access(acc, handler_info, false, cpu.vcpu->id);
         spin_unlock(&cpu.vcpu->vm->arch.vgicd.lock);
         return true;
@@ -873,10 +867,12 @@ bool vgicd_emul_handler(emul_access_t *acc)
 
 void vgic_inject(vgicd_t *vgicd, uint64_t id, uint64_t source)
 {
+    TRACE(TRACE_IRQ_INJECT, id, source);
+
     vgic_int_t *interrupt = vgic_get_int(cpu.vcpu, id, cpu.vcpu->id);
     if (interrupt != NULL) {
         if (vgic_int_is_hw(interrupt)) {
-            spin_lock(&interrupt->lock);
+            spin_lock_class(&interrupt->lock, SPINLOCK_CLASS_VIRQ);
             interrupt->owner = cpu.vcpu;
             interrupt->state = PEND;
             interrupt->in_lr = false;
@@ -914,7 +910,7 @@ void vgic_ipi_handler(uint32_t event, uint64_t data)
             vgic_int_t *interrupt =
                 vgic_get_int(cpu.vcpu, int_id, cpu.vcpu->id);
             if (interrupt != NULL) {
-                spin_lock(&interrupt->lock);
+                spin_lock_class(&interrupt->lock, SPINLOCK_CLASS_VIRQ);
                 if (vgic_get_ownership(cpu.vcpu, interrupt)) {
                     if (vgic_int_vcpu_is_target(cpu.vcpu, interrupt)) {
                         vgic_add_lr(cpu.vcpu, interrupt);
@@ -968,7 +964,7 @@ void vgic_refill_lrs(vcpu_t *vcpu)
         for (int i = 0; i < gic_num_irqs(); i++) {
             vgic_int_t *temp_int = vgic_get_int(vcpu, i, vcpu->id);
             if (temp_int == NULL) break;
-            spin_lock(&temp_int->lock);
+            spin_lock_class(&temp_int->lock, SPINLOCK_CLASS_VIRQ);
             if (vgic_get_ownership(vcpu, temp_int)) {
                 uint8_t temp_state = vgic_get_state(temp_int);
                 bool cpu_is_target = vgic_int_vcpu_is_target(vcpu, temp_int);
@@ -996,6 +992,7 @@ void vgic_refill_lrs(vcpu_t *vcpu)
         }
 
         if (interrupt != NULL) {
+            TRACE(TRACE_LR_REFILL, interrupt->id, lr_ind);
             vgic_write_lr(vcpu, interrupt, lr_ind);
             has_pend = has_pend || prev_pend;
             spin_unlock(&interrupt->lock);
@@ -1013,7 +1010,7 @@ void vgic_eoir_highest_spilled_active(vcpu_t *vcpu)
         vgic_int_t *temp_int = vgic_get_int(vcpu, i, vcpu->id);
         if (temp_int == NULL) break;
 
-        spin_lock(&temp_int->lock);
+        spin_lock_class(&temp_int->lock, SPINLOCK_CLASS_VIRQ);
         if (vgic_get_ownership(vcpu, temp_int) && (temp_int->state & ACT)) {
             if (interrupt == NULL || (interrupt->prio < temp_int->prio)) {
                 vgic_int_t *aux = interrupt;
@@ -1055,7 +1052,7 @@ void vgic_handle_trapped_eoir(vcpu_t *vcpu)
             vgic_get_int(vcpu, GICH_LR_VID(lr_val), vcpu->id);
         if (interrupt == NULL) continue;
 
-        spin_lock(&interrupt->lock);
+        spin_lock_class(&interrupt->lock, SPINLOCK_CLASS_VIRQ);
         interrupt->in_lr = false;
         if (interrupt->id < GIC_MAX_SGIS) {
             vgic_add_lr(vcpu, interrupt);
@@ -1122,7 +1119,7 @@ void vgic_set_hw(vm_t *vm, uint64_t id)
         {
             interrupt = vgic_get_int(vcpu, id, vcpu->id);
             if (interrupt != NULL) {
-                spin_lock(&interrupt->lock);
+                spin_lock_class(&interrupt->lock, SPINLOCK_CLASS_VIRQ);
                 interrupt->hw = true;
                 spin_unlock(&interrupt->lock);
             }
@@ -1133,7 +1130,7 @@ void vgic_set_hw(vm_t *vm, uint64_t id)
          */
         interrupt = vgic_get_int((vcpu_t *)list_peek(&vm->vcpu_list), id, 0);
         if (interrupt != NULL) {
-            spin_lock(&interrupt->lock);
+            spin_lock_class(&interrupt->lock, SPINLOCK_CLASS_VIRQ);
             interrupt->hw = true;
             spin_unlock(&interrupt->lock);
         } else {
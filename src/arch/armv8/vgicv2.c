@@ -119,7 +119,7 @@ struct vgic_reg_handler_info sgir_info = {
 
 void vgic_inject_sgi(vcpu_t *vcpu, vgic_int_t *interrupt, uint64_t source)
 {
-    spin_lock(&interrupt->lock);
+    spin_lock_class(&interrupt->lock, SPINLOCK_CLASS_VIRQ);
 
     vgic_remove_lr(vcpu, interrupt);
 
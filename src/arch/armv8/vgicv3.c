@@ -215,7 +215,7 @@ bool vgicr_emul_handler(emul_access_t *acc)
         vcpu_t *vcpu = vgicr_id == cpu.vcpu->id
                            ? cpu.vcpu
                            : vm_get_vcpu(cpu.vcpu->vm, vgicr_id);
-        spin_lock(&vcpu->arch.vgic_priv.vgicr.lock);
+        spin_lock_class(&vcpu->arch.vgic_priv.vgicr.lock, SPINLOCK_CLASS_VIRQ);
         handler_info->reg_access(acc, handler_info, true, vgicr_id);
         spin_unlock(&vcpu->arch.vgic_priv.vgicr.lock);
         return true;
@@ -0,0 +1,107 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#ifndef __ARCH_ATOMIC_H__
+#define __ARCH_ATOMIC_H__
+
+#include <bao.h>
+#include <arch/fences.h>
+
+/**
+ * Atomically replaces *ptr by new if it still holds old. Returns true on
+ * success. Has acquire and release semantics.
+ */
+static inline bool atomic_cas64(volatile uint64_t* ptr, uint64_t old,
+                                uint64_t new)
+{
+    uint64_t tmp;
+    uint64_t fail;
+
+    asm volatile(
+        "1:\n\t"
+        "lr.d.aqrl %0, %2 \n\t"
+        "bne %0, %3, 2f \n\t"
+        "sc.d.rl %1, %4, %2 \n\t"
+        "bnez %1, 1b \n\t"
+        "2:\n\t"
+        : "=&r"(tmp), "=&r"(fail), "+A"(*ptr)
+        : "r"(old), "r"(new)
+        : "memory");
+
+    return tmp == old;
+}
+
+/**
+ * Atomically adds val to *ptr and returns the resulting value.
+ */
+static inline uint64_t atomic_add64(volatile uint64_t* ptr, uint64_t val)
+{
+    uint64_t old;
+
+    asm volatile("amoadd.d.aqrl %0, %2, %1 \n\t"
+                 : "=&r"(old), "+A"(*ptr)
+                 : "r"(val)
+                 : "memory");
+
+    return old + val;
+}
+
+/**
+ * Atomically replaces *ptr by val and returns its previous value.
+ */
+static inline uint64_t atomic_swap64(volatile uint64_t* ptr, uint64_t val)
+{
+    uint64_t old;
+
+    asm volatile("amoswap.d.aqrl %0, %2, %1 \n\t"
+                 : "=&r"(old), "+A"(*ptr)
+                 : "r"(val)
+                 : "memory");
+
+    return old;
+}
+
+/**
+ * Waits until *ptr no longer holds val. With Zawrs, wrs.nto stalls the hart
+ * until the reservation taken by the lr is lost to a write. Has acquire
+ * semantics.
+ */
+static inline void atomic_wait_ne64(volatile uint64_t* ptr, uint64_t val)
+{
+#ifdef __riscv_zawrs
+    uint64_t tmp;
+
+    asm volatile(
+        "1:\n\t"
+        "lr.d.aq %0, %1 \n\t"
+        "bne %0, %2, 2f \n\t"
+        ".4byte 0x00d00073 \n\t" /* wrs.nto */
+        "j 1b \n\t"
+        "2:\n\t"
+        : "=&r"(tmp), "+A"(*ptr)
+        : "r"(val)
+        : "memory");
+#else
+    while (*ptr == val);
+    fence_ord_read();
+#endif
+}
+
+/**
+ * Waiters only depend on the write to the watched location to wake up.
+ */
+static inline void atomic_wake() {}
+
+#endif /* __ARCH_ATOMIC_H__ */
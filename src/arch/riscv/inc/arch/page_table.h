@@ -75,6 +75,10 @@
 #define PTE_VM_FLAGS (PTE_VALID | PTE_ACCESS | PTE_DIRTY | PTE_USER)
 #define PTE_VM_DEV_FLAGS PTE_VM_FLAGS
 
+/* No contiguous hint, entries are never grouped */
+#define PTE_CONTIG_NUM (1)
+#define PTE_CONTIG (0)
+
 #ifndef __ASSEMBLER__
 
 typedef uint64_t pte_t;
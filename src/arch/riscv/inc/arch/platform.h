@@ -20,6 +20,7 @@
 
 struct arch_platform {
     uintptr_t plic_base;
+    uint64_t timebase_freq;
 };
 
 #endif /* __ARCH_PLATFORM_H__ */
\ No newline at end of file
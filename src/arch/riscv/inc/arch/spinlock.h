@@ -18,29 +18,55 @@
 
 #include <bao.h>
 
+/**
+ * Ticket lock. The low half is the ticket being served (owner) and the high
+ * half is the next ticket to hand out.
+ */
 typedef volatile uint32_t __attribute__((aligned(4))) spinlock_t;
 
 #define SPINLOCK_INITVAL (0)
+#define SPINLOCK_NEXT_SHIFT (16)
+#define SPINLOCK_OWNER_MSK (0xffff)
+
+#ifdef __riscv_zawrs
+#define SPINLOCK_WAIT ".4byte 0x00d00073 \n\t" /* wrs.nto */
+#else
+#define SPINLOCK_WAIT
+#endif
 
 static inline void spin_lock(spinlock_t* lock)
 {
-    int const ONE = 1;
-    spinlock_t tmp = SPINLOCK_INITVAL;
-
-    asm volatile("1:\n\t"
-                 "lr.w.aq  %0, %1 \n\t"
-                 "bne      %0, zero, 1b \n\t"
-                 "sc.w.rl  %0, %2, %1 \n\t"
-                 "bne      %0, zero, 1b \n\t"
-                 : "=&r"(tmp), "+A"(*lock)
-                 : "r"(ONE));
+    uint32_t const INC = 1 << SPINLOCK_NEXT_SHIFT;
+    uint64_t ticket, owner;
+
+    asm volatile(
+        /* Take a ticket */
+        "amoadd.w.aq %0, %3, %2 \n\t"
+        "srliw %0, %0, 16 \n\t"
+        /**
+         * Wait for the owner to reach it. With Zawrs, the hart stalls until
+         * the lr's reservation is lost to the owner's update.
+         */
+        "1:\n\t"
+        "lr.w.aq %1, %2 \n\t"
+        "slli %1, %1, 48 \n\t"
+        "srli %1, %1, 48 \n\t"
+        "beq %1, %0, 2f \n\t"
+        SPINLOCK_WAIT
+        "j 1b \n\t"
+        "2:\n\t"
+        : "=&r"(ticket), "=&r"(owner), "+A"(*lock)
+        : "r"(INC)
+        : "memory");
 }
 
 static inline void spin_unlock(spinlock_t* lock)
 {
-    asm volatile("sw zero, %0\n\t"
-                 "fence rw, rw\n\t"  // Is the full blown barrier really needed?
-                 ::"m"(*lock));
+    volatile uint16_t* owner = (volatile uint16_t*)lock;
+
+    /* Only the holder writes the owner, so it can be updated non-atomically */
+    asm volatile("fence rw, w\n\t" ::: "memory");
+    *owner = *owner + 1;
 }
 
 #endif /* __ARCH_SPINLOCK__ */
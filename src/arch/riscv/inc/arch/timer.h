@@ -0,0 +1,33 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#ifndef __ARCH_TIMER_H__
+#define __ARCH_TIMER_H__
+
+#include <bao.h>
+#include <platform.h>
+#include <arch/csrs.h>
+
+static inline uint64_t timer_arch_get()
+{
+    return CSRR(time);
+}
+
+static inline uint64_t timer_arch_freq()
+{
+    return platform.arch.timebase_freq;
+}
+
+#endif /* __ARCH_TIMER_H__ */
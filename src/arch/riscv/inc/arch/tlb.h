@@ -50,4 +50,32 @@ static inline void tlb_vm_inv_all(uint64_t vmid)
     sbi_remote_hfence_gvma_vmid((1 << platform.cpu_num) - 1, 0, 0, 0, vmid);
 }
 
+/**
+ * Above these many pages, invalidating a whole range costs more than
+ * invalidating every entry of the VMID (or the hypervisor).
+ */
+#define TLB_INV_MAX_PAGES (512)
+
+static inline void tlb_vm_inv_range(uint64_t vmid, void* va, size_t size)
+{
+    if (size > TLB_INV_MAX_PAGES * PAGE_SIZE) {
+        tlb_vm_inv_all(vmid);
+        return;
+    }
+
+    sbi_remote_hfence_gvma_vmid((1 << platform.cpu_num) - 1, 0,
+                                (unsigned long)va, size, vmid);
+}
+
+static inline void tlb_hyp_inv_range(void* va, size_t size)
+{
+    if (size > TLB_INV_MAX_PAGES * PAGE_SIZE) {
+        tlb_hyp_inv_all();
+        return;
+    }
+
+    sbi_remote_sfence_vma((1 << platform.cpu_num) - 1, 0, (unsigned long)va,
+                          size);
+}
+
 #endif /* __ARCH_TLB_H__ */
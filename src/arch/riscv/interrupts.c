@@ -24,6 +24,7 @@
 #include <vm.h>
 #include <arch/csrs.h>
 #include <fences.h>
+#include <trace.h>
 
 void interrupts_arch_init()
 {
@@ -56,6 +57,11 @@ void interrupts_arch_ipi_send(uint64_t target_cpu, uint64_t ipi_id)
     sbi_send_ipi(1ULL << target_cpu, 0);
 }
 
+void interrupts_arch_ipi_send_mask(uint64_t cpu_mask, uint64_t ipi_id)
+{
+    sbi_send_ipi(cpu_mask, 0);
+}
+
 void interrupts_arch_cpu_enable(bool en)
 {
     if (en) {
@@ -87,6 +93,8 @@ void interrupts_arch_handle()
 {
     unsigned long _scause = CSRR(scause);
 
+    TRACE(TRACE_VM_EXIT, TRACE_EXIT_IRQ, _scause);
+
     switch (_scause) {
         case SCAUSE_CODE_SSI:
             interrupts_handle(SOFT_INT_ID);
@@ -109,6 +117,8 @@ void interrupts_arch_handle()
             // WARNING("unkown interrupt");
             break;
     }
+
+    TRACE(TRACE_VM_ENTRY, 0, 0);
 }
 
 bool interrupts_arch_check(uint64_t int_id)
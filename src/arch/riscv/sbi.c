@@ -20,6 +20,8 @@
 #include <bitmap.h>
 #include <fences.h>
 #include <hypercall.h>
+#include <stats.h>
+#include <balloon.h>
 
 #define SBI_EXTID_BASE (0x10)
 #define SBI_GET_SBI_SPEC_VERSION_FID (0)
@@ -266,13 +268,15 @@ struct sbiret sbi_ipi_handler(unsigned long fid)
         .event = SEND_IPI,
     };
 
+    uint64_t phart_mask = 0;
     for (size_t i = 0; i < sizeof(hart_mask) * 8; i++) {
         if (bitmap_get((bitmap_t)&hart_mask, i)) {
             uint64_t vhart_id = hart_mask_base + i;
             int64_t phart_id = vm_translate_to_pcpuid(cpu.vcpu->vm, vhart_id); 
-            if(phart_id >= 0) cpu_send_msg(phart_id, &msg);
+            if(phart_id >= 0) phart_mask |= 1ULL << phart_id;
         }
     }
+    cpu_send_msg_mask(phart_mask, &msg);
 
     return (struct sbiret){SBI_SUCCESS};
 }
@@ -344,10 +348,14 @@ struct sbiret sbi_rfence_handler(unsigned long fid)
     return ret;
 }
 
+/* Max time hart_start waits for the target hart to start */
+#define SBI_HART_START_TIMEOUT_US (1000)
+
 struct sbiret sbi_hsm_start_handler() {
     
     struct sbiret ret;
     uint64_t vhart_id = vcpu_readreg(cpu.vcpu, REG_A0);
+    bool start = false;
     
     if(vhart_id == cpu.vcpu->id){
         ret.error = SBI_ERR_ALREADY_AVAILABLE;
@@ -370,16 +378,26 @@ struct sbiret sbi_hsm_start_handler() {
 
                 fence_sync_write();
 
+                start = true;
+                ret.error = SBI_SUCCESS; 
+            }
+            spin_unlock(&vcpu->arch.sbi_ctx.lock);
+
+            /**
+             * The target takes the context lock to start, so wait for it
+             * only after releasing it. Once the call returns, hart_status
+             * already reports the target started, unless it took too long.
+             * It still starts later on, as the request was accepted.
+             */
+            if (start) {
                 cpu_msg_t msg = {
                     .handler = SBI_MSG_ID,
                     .event = HART_START,
                     .data = 0xdeadbeef
                 };
-                cpu_send_msg(vcpu->phys_id, &msg);
-               
-                ret.error = SBI_SUCCESS; 
+                cpu_call(1ULL << vcpu->phys_id, &msg,
+                         SBI_HART_START_TIMEOUT_US);
             }
-            spin_unlock(&vcpu->arch.sbi_ctx.lock);
        }
    }
 
@@ -429,10 +447,17 @@ struct sbiret sbi_bao_handler(unsigned long fid){
     uint64_t arg1 = vcpu_readreg(cpu.vcpu, REG_A1);
     uint64_t arg2 = vcpu_readreg(cpu.vcpu, REG_A2);
 
+    stats_hypercall_exit(fid);
     switch(fid) {
         case HC_IPC:
                 ret.error = ipc_hypercall(arg0, arg1, arg2);
             break;
+        case HC_BALLOON:
+                ret.error = balloon_hypercall(arg0, arg1, arg2);
+            break;
+        case HC_STATS:
+                ret.error = stats_hypercall(arg0, arg1, arg2);
+            break;
         default:
             ret.error = -HC_E_INVAL_ID;
    }
@@ -19,6 +19,8 @@
 #include <arch/encoding.h>
 #include <arch/csrs.h>
 #include <arch/instructions.h>
+#include <stats.h>
+#include <trace.h>
 
 void internal_exception_handler(unsigned long gprs[]) {
 
@@ -90,10 +92,47 @@ static inline bool is_pseudo_ins(uint32_t ins) {
     return ins == TINST_PSEUDO_STORE || ins == TINST_PSEUDO_LOAD;
 }
 
+/**
+ * Reflects the current guest page fault back to the guest as an access fault
+ * of the given cause, taken to its VS-mode trap vector as if no memory was
+ * there.
+ */
+static void guest_inject_access_fault(uint64_t cause)
+{
+    uint64_t vsstatus = CSRR(CSR_VSSTATUS);
+    uint64_t sie = vsstatus & SSTATUS_SIE_BIT;
+
+    vsstatus &= ~(SSTATUS_SPP_BIT | SSTATUS_SPIE_BIT | SSTATUS_SIE_BIT);
+    vsstatus |= cpu.vcpu->regs->sstatus & SSTATUS_SPP_BIT;
+    vsstatus |= sie ? SSTATUS_SPIE_BIT : 0;
+
+    CSRW(CSR_VSSTATUS, vsstatus);
+    CSRW(CSR_VSCAUSE, cause);
+    CSRW(CSR_VSTVAL, CSRR(stval));
+    CSRW(CSR_VSEPC, cpu.vcpu->regs->sepc);
+
+    /* enter the guest's trap vector in VS-mode */
+    cpu.vcpu->regs->sstatus |= SSTATUS_SPP_BIT;
+    cpu.vcpu->regs->sepc = CSRR(CSR_VSTVEC) & ~0x3ULL;
+}
+
 size_t guest_page_fault_handler()
 {
     uintptr_t addr = CSRR(CSR_HTVAL) << 2;
 
+    /**
+     * Faults on the vm's own memory are not emulated. Either the access is
+     * replayed on the now mapped page, or the guest gets an access fault.
+     */
+    if (vm_mem_is_ram(cpu.vcpu->vm, addr)) {
+        if (!vm_mem_populate(cpu.vcpu->vm, addr)) {
+            guest_inject_access_fault(CSRR(scause) == SCAUSE_CODE_SGPF
+                                          ? SCAUSE_CODE_SAF
+                                          : SCAUSE_CODE_LAF);
+        }
+        return 0;
+    }
+
     emul_handler_t handler = vm_emul_get_mem(cpu.vcpu->vm, addr);
     if (handler != NULL) {
 
@@ -142,8 +181,25 @@ size_t guest_page_fault_handler()
     }
 }
 
+size_t guest_inst_page_fault_handler()
+{
+    uintptr_t addr = CSRR(CSR_HTVAL) << 2;
+
+    if (!vm_mem_is_ram(cpu.vcpu->vm, addr)) {
+        ERROR("no handler for instruction fault (0x%x at 0x%x)", addr,
+              CSRR(sepc));
+    }
+
+    if (!vm_mem_populate(cpu.vcpu->vm, addr)) {
+        guest_inject_access_fault(SCAUSE_CODE_IAF);
+    }
+
+    return 0;
+}
+
 sync_handler_t sync_handler_table[] = {
     [SCAUSE_CODE_ECV] = sbi_vs_handler,
+    [SCAUSE_CODE_IGPF] = guest_inst_page_fault_handler,
     [SCAUSE_CODE_LGPF] = guest_page_fault_handler,
     [SCAUSE_CODE_SGPF] = guest_page_fault_handler,
 };
@@ -153,9 +209,12 @@ static const size_t sync_handler_table_size =
 
 void sync_exception_handler()
 {
+    uint64_t start = stats_timestamp();
     size_t pc_step = 0;
     unsigned long _scause = CSRR(scause);
 
+    TRACE(TRACE_VM_EXIT, TRACE_EXIT_SYNC, _scause);
+
     if(!(CSRR(CSR_HSTATUS) & HSTATUS_SPV)) {
         internal_exception_handler(&cpu.vcpu->regs->x[0]);
     }
@@ -170,4 +229,7 @@ void sync_exception_handler()
     }
 
     cpu.vcpu->regs->sepc += pc_step;
+
+    stats_sync_exit(_scause, start);
+    TRACE(TRACE_VM_ENTRY, 0, 0);
 }
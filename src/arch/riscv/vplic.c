@@ -18,6 +18,7 @@
 #include <emul.h>
 #include <mem.h>
 #include <vm.h>
+#include <trace.h>
 #include <interrupts.h>
 #include <arch/csrs.h>
 
@@ -152,7 +153,7 @@ static void vplic_ipi_handler(uint32_t event, uint64_t data)
 static void vplic_set_threshold(vcpu_t* vcpu, int vcntxt, uint32_t threshold) 
 {
     vplic_t * vplic = &vcpu->vm->arch.vplic;
-    spin_lock(&vplic->lock);
+    spin_lock_class(&vplic->lock, SPINLOCK_CLASS_VIRQ);
     vplic->threshold[vcntxt] = threshold;
     int pcntxt = vplic_vcntxt_to_pcntxt(vcpu, vcntxt);
     plic_set_threshold(pcntxt, threshold);
@@ -164,7 +165,7 @@ static void vplic_set_threshold(vcpu_t* vcpu, int vcntxt, uint32_t threshold)
 static void vplic_set_enbl(vcpu_t* vcpu, int vcntxt, int id, bool set)
 {
     vplic_t * vplic = &vcpu->vm->arch.vplic;
-    spin_lock(&vplic->lock);
+    spin_lock_class(&vplic->lock, SPINLOCK_CLASS_VIRQ);
     if (id <= PLIC_MAX_INTERRUPTS && vplic_get_enbl(vcpu, vcntxt, id) != set) {
         if(set){
             bitmap_set(vplic->enbl[vcntxt],id);
@@ -185,7 +186,7 @@ static void vplic_set_enbl(vcpu_t* vcpu, int vcntxt, int id, bool set)
 static void vplic_set_prio(vcpu_t *vcpu, int id, uint32_t prio)
 {
     vplic_t *vplic = &vcpu->vm->arch.vplic;
-    spin_lock(&vplic->lock);
+    spin_lock_class(&vplic->lock, SPINLOCK_CLASS_VIRQ);
     if (id <= PLIC_MAX_INTERRUPTS && vplic_get_prio(vcpu, id) != prio) {
         vplic->prio[id] = prio;
         if(vplic_get_hw(vcpu,id)){
@@ -204,7 +205,7 @@ static void vplic_set_prio(vcpu_t *vcpu, int id, uint32_t prio)
 
 static int vplic_claim(vcpu_t *vcpu, int vcntxt)
 {
-    spin_lock(&vcpu->vm->arch.vplic.lock);
+    spin_lock_class(&vcpu->vm->arch.vplic.lock, SPINLOCK_CLASS_VIRQ);
     int int_id = vplic_next_pending(vcpu, vcntxt);
     bitmap_clear(vcpu->vm->arch.vplic.pend, int_id);
     bitmap_set(vcpu->vm->arch.vplic.act, int_id);
@@ -220,7 +221,7 @@ static void vplic_complete(vcpu_t *vcpu, int vcntxt, int int_id)
         plic_hart[cpu.arch.plic_cntxt].complete = int_id;
     }
 
-    spin_lock(&vcpu->vm->arch.vplic.lock);
+    spin_lock_class(&vcpu->vm->arch.vplic.lock, SPINLOCK_CLASS_VIRQ);
     bitmap_clear(vcpu->vm->arch.vplic.act, int_id);
     spin_unlock(&vcpu->vm->arch.vplic.lock);
 
@@ -229,8 +230,10 @@ static void vplic_complete(vcpu_t *vcpu, int vcntxt, int int_id)
 
 void vplic_inject(vcpu_t *vcpu, int id)
 {
+    TRACE(TRACE_IRQ_INJECT, id, 0);
+
     vplic_t * vplic = &vcpu->vm->arch.vplic;
-    spin_lock(&vplic->lock);
+    spin_lock_class(&vplic->lock, SPINLOCK_CLASS_VIRQ);
     if (id > 0 && id <= PLIC_MAX_INTERRUPTS && !vplic_get_pend(vcpu, id)) {
         
         bitmap_set(vplic->pend, id);
@@ -0,0 +1,62 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#include <alternative.h>
+#include <cpu.h>
+#include <fences.h>
+#include <string.h>
+
+extern alt_entry_t _alternatives_start, _alternatives_end;
+
+uint64_t cpu_features;
+
+static volatile bool alternatives_done;
+
+__attribute__((weak)) uint64_t alternatives_arch_detect()
+{
+    return 0;
+}
+
+__attribute__((weak)) void alternatives_arch_sync(void *addr, size_t size) {}
+
+__attribute__((weak)) void alternatives_arch_sync_local() {}
+
+/**
+ * The master patches the image before any other cpu runs code that might be
+ * patched, so no one executes a half written sequence. The others wait for
+ * it on a plain flag and then discard any stale instructions they fetched.
+ */
+void alternatives_init(uint64_t cpu_id)
+{
+    if (cpu_id == CPU_MASTER) {
+        cpu_features = alternatives_arch_detect();
+
+        for (alt_entry_t *alt = &_alternatives_start; alt < &_alternatives_end;
+             alt++) {
+            if (cpu_has_feature(alt->feature) &&
+                alt->orig_len == alt->repl_len) {
+                memcpy((void *)alt->orig, (void *)alt->repl, alt->orig_len);
+                alternatives_arch_sync((void *)alt->orig, alt->orig_len);
+            }
+        }
+
+        fence_sync();
+        alternatives_done = true;
+    } else {
+        while (!alternatives_done);
+    }
+
+    alternatives_arch_sync_local();
+}
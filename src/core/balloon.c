@@ -0,0 +1,193 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#include <balloon.h>
+
+#include <cpu.h>
+#include <vm.h>
+#include <mem.h>
+#include <hypercall.h>
+#include <string.h>
+
+/**
+ * Max number of pages in the list of a single release, copied to the stack.
+ */
+#define BALLOON_LIST_MAX (64)
+
+/**
+ * Pages are claimed in chunks of this many pages, so the pages need not be
+ * contiguous in the page pool.
+ */
+#define BALLOON_CLAIM_CHUNK (16)
+
+static bool balloon_in_window(vm_t* vm, uint64_t addr, size_t n)
+{
+    uint64_t base = vm->config->balloon.base;
+    size_t size = vm->config->balloon.size;
+    return (addr >= base) && (addr - base < size) &&
+           (n <= (size - (addr - base)) / PAGE_SIZE);
+}
+
+/**
+ * Only the vm's own memory may be released, i.e., pages of regions not
+ * placed at a fixed physical address or of its balloon window.
+ */
+static bool balloon_releasable(vm_t* vm, uint64_t addr)
+{
+    const vm_config_t* config = vm->config;
+
+    if ((addr & (PAGE_SIZE - 1)) != 0) return false;
+    if (balloon_in_window(vm, addr, 1)) return true;
+
+    for (int i = 0; i < config->platform.region_num; i++) {
+        struct mem_region* reg = &config->platform.regions[i];
+        if (!reg->place_phys && addr >= reg->base &&
+            addr - reg->base < reg->size) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Unmaps the pages listed at guest address list and returns them to the
+ * page pools. Runs of contiguous pages are unmapped at once, so their TLB
+ * entries are invalidated together.
+ */
+static int64_t balloon_release(vm_t* vm, uint64_t list, size_t n)
+{
+    uint64_t pages[BALLOON_LIST_MAX];
+    uint64_t list_pa = 0;
+
+    if ((n == 0) || (n > BALLOON_LIST_MAX) ||
+        (list % sizeof(uint64_t)) != 0 ||
+        ((list & (PAGE_SIZE - 1)) + n * sizeof(uint64_t)) > PAGE_SIZE ||
+        !vm_mem_translate(vm, list, &list_pa)) {
+        return -HC_E_INVAL_ARGS;
+    }
+
+    /* copy the list so it cant change after being checked */
+    ppages_t list_pp = mem_ppages_get(list_pa & ~(PAGE_SIZE - 1), 1);
+    void* list_va = mem_alloc_vpage(&cpu.as, SEC_HYP_PRIVATE, NULL, 1);
+    mem_map(&cpu.as, list_va, &list_pp, 1, PTE_HYP_FLAGS);
+    memcpy(pages, list_va + (list & (PAGE_SIZE - 1)), n * sizeof(uint64_t));
+    mem_free_vpage(&cpu.as, list_va, 1, false);
+
+    int64_t ret = HC_E_SUCCESS;
+
+    spin_lock(&vm->lock);
+
+    for (size_t i = 0; i < n; i++) {
+        if (!balloon_releasable(vm, pages[i]) ||
+            !vm_mem_translate(vm, pages[i], NULL)) {
+            ret = -HC_E_INVAL_ARGS;
+            break;
+        }
+    }
+
+    for (size_t i = 0; (ret == HC_E_SUCCESS) && (i < n);) {
+        size_t run = 1;
+        if (!vm_mem_translate(vm, pages[i], NULL)) {
+            /* listed twice, already released */
+            i++;
+            continue;
+        }
+        while ((i + run < n) &&
+               (pages[i + run] == pages[i] + run * PAGE_SIZE)) {
+            run++;
+        }
+        mem_unmap(&vm->as, (void*)pages[i], run, true);
+        for (size_t j = i; j < i + run; j++) {
+            /**
+             * Pages of lazy regions are populated again if the guest
+             * touches them, so they are not credited to its quota.
+             */
+            if (!vm_mem_is_lazy(vm, pages[j])) {
+                vm->balloon_pages--;
+            }
+        }
+        i += run;
+    }
+
+    spin_unlock(&vm->lock);
+
+    return ret;
+}
+
+/**
+ * Maps n new zeroed pages at guest address addr, in the vm's balloon window,
+ * as long as the vm stays within its quota.
+ */
+static int64_t balloon_claim(vm_t* vm, uint64_t addr, size_t n)
+{
+    int64_t quota = vm->config->balloon.quota;
+
+    if ((n == 0) || ((addr & (PAGE_SIZE - 1)) != 0) ||
+        !balloon_in_window(vm, addr, n)) {
+        return -HC_E_INVAL_ARGS;
+    }
+
+    int64_t ret = HC_E_SUCCESS;
+
+    spin_lock(&vm->lock);
+
+    if (vm->balloon_pages + (int64_t)n > quota) {
+        ret = -HC_E_FAILURE;
+    }
+
+    for (size_t i = 0; (ret == HC_E_SUCCESS) && (i < n); i++) {
+        if (vm_mem_translate(vm, addr + i * PAGE_SIZE, NULL)) {
+            ret = -HC_E_INVAL_ARGS;
+        }
+    }
+
+    size_t count = 0;
+    while ((ret == HC_E_SUCCESS) && (count < n)) {
+        size_t chunk = min(n - count, BALLOON_CLAIM_CHUNK);
+        if (vm_mem_map_zeroed(vm, addr + count * PAGE_SIZE, NULL, chunk) < 0) {
+            /* out of memory, give back what was taken so far */
+            mem_unmap(&vm->as, (void*)addr, count, true);
+            ret = -HC_E_FAILURE;
+        } else {
+            count += chunk;
+        }
+    }
+
+    if (ret == HC_E_SUCCESS) {
+        vm->balloon_pages += n;
+    }
+
+    spin_unlock(&vm->lock);
+
+    return ret;
+}
+
+int64_t balloon_hypercall(uint64_t arg0, uint64_t arg1, uint64_t arg2)
+{
+    vm_t* vm = cpu.vcpu->vm;
+    int64_t ret = -HC_E_INVAL_ARGS;
+
+    switch (arg0) {
+        case BALLOON_RELEASE:
+            ret = balloon_release(vm, arg1, arg2);
+            break;
+        case BALLOON_CLAIM:
+            ret = balloon_claim(vm, arg1, arg2);
+            break;
+    }
+
+    return ret;
+}
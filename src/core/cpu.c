@@ -20,6 +20,9 @@
 #include <objcache.h>
 #include <vm.h>
 #include <fences.h>
+#include <atomic.h>
+#include <timer.h>
+#include <trace.h>
 
 typedef struct {
     node_t node;
@@ -31,6 +34,7 @@ cpu_t cpu __attribute__((section(".cpu_private")));
 cpu_synctoken_t cpu_glb_sync = {.ready = false};
 
 objcache_t msg_cache;
+objcache_t call_cache;
 extern cpu_msg_handler_t _ipi_cpumsg_handlers_start;
 extern uint64_t _ipi_cpumsg_handlers_size, _ipi_cpumsg_handlers_id_start;
 cpu_msg_handler_t *ipi_cpumsg_handlers;
@@ -41,12 +45,24 @@ void cpu_init(uint64_t cpu_id, uint64_t load_addr)
     cpu_arch_init(cpu_id, load_addr);
 
     cpu.id = cpu_id;
-    list_init(&cpu.interface.event_list);
+    cpu.interface.msg_head = 0;
+    cpu.interface.msg_tail = 0;
+    cpu.interface.msg_ipi_pending = 0;
+    for (size_t i = 0; i < CPU_MSG_RING_SIZE; i++) {
+        cpu.interface.msg_ring[i].seq = i;
+    }
+    list_init(&cpu.interface.msg_overflow);
 
     if (cpu.id == CPU_MASTER) {
         cpu_sync_init(&cpu_glb_sync, platform.cpu_num);
+        /**
+         * Overflow nodes are freed by the target cpu and fully rewritten on
+         * send.
+         */
         objcache_init(&msg_cache, sizeof(cpu_msg_node_t), SEC_HYP_GLOBAL,
-                      false);
+                      OBJCACHE_MAG | OBJCACHE_NOZERO);
+        objcache_init(&call_cache, sizeof(cpu_call_t), SEC_HYP_GLOBAL,
+                      OBJCACHE_MAG | OBJCACHE_NOZERO);
 
         ipi_cpumsg_handlers = &_ipi_cpumsg_handlers_start;
         ipi_cpumsg_handler_num =
@@ -59,23 +75,122 @@ void cpu_init(uint64_t cpu_id, uint64_t load_addr)
     cpu_sync_barrier(&cpu_glb_sync);
 }
 
+/**
+ * Reserve the ring's next position and publish the message in its slot.
+ * Fails if the ring is full.
+ */
+static bool cpu_msg_ring_push(cpuif_t *cpuif, cpu_msg_t *msg)
+{
+    uint64_t pos = cpuif->msg_head;
+
+    while (true) {
+        cpu_msg_slot_t *slot = &cpuif->msg_ring[pos % CPU_MSG_RING_SIZE];
+        int64_t dif = (int64_t)(slot->seq - pos);
+
+        if (dif == 0) {
+            if (atomic_cas64(&cpuif->msg_head, pos, pos + 1)) {
+                slot->msg = *msg;
+                fence_ord_write();
+                slot->seq = pos + 1;
+                return true;
+            }
+        } else if (dif < 0) {
+            /* the slot still holds the message of the previous lap */
+            return false;
+        }
+
+        pos = cpuif->msg_head;
+    }
+}
+
+static bool cpu_msg_ring_pop(cpuif_t *cpuif, cpu_msg_t *msg)
+{
+    uint64_t pos = cpuif->msg_tail;
+    cpu_msg_slot_t *slot = &cpuif->msg_ring[pos % CPU_MSG_RING_SIZE];
+
+    if (slot->seq != pos + 1) return false;
+
+    fence_ord_read();
+    *msg = slot->msg;
+    /* the message must be read before the slot is handed back */
+    fence_ord();
+    slot->seq = pos + CPU_MSG_RING_SIZE;
+    cpuif->msg_tail = pos + 1;
+
+    return true;
+}
+
+static void cpu_msg_enqueue(cpuif_t *cpuif, cpu_msg_t *msg)
+{
+    /**
+     * Once messages spill to the overflow list, keep using it until the
+     * target drains it, so that messages from a given cpu stay in order.
+     */
+    if (!list_empty(&cpuif->msg_overflow) || !cpu_msg_ring_push(cpuif, msg)) {
+        cpu_msg_node_t *node = objcache_alloc(&msg_cache);
+        if (node == NULL) ERROR("cant allocate msg node");
+        node->msg = *msg;
+        list_push(&cpuif->msg_overflow, (node_t *)node);
+#ifdef BAO_STATS
+        atomic_add64(&cpuif->msg_stats.overflows, 1);
+#endif
+    }
+}
+
+/**
+ * Send the message to all cpus in the mask. The messages are all queued
+ * before a single IPI operation is raised for the targets that don't have
+ * one pending already.
+ */
+void cpu_send_msg_mask(uint64_t cpu_mask, cpu_msg_t *msg)
+{
+    uint64_t ipi_mask = 0;
+
+    TRACE(TRACE_MSG_SEND, cpu_mask,
+          ((uint64_t)msg->handler << 32) | msg->event);
+
+    for (size_t i = 0; i < platform.cpu_num; i++) {
+        if (cpu_mask & (1ULL << i)) {
+            cpu_msg_enqueue(cpu_if(i), msg);
+        }
+    }
+
+    /* the messages must be visible before the pending flags are checked */
+    fence_ord();
+
+    for (size_t i = 0; i < platform.cpu_num; i++) {
+        if ((cpu_mask & (1ULL << i)) &&
+            atomic_swap64(&cpu_if(i)->msg_ipi_pending, 1) == 0) {
+            ipi_mask |= 1ULL << i;
+#ifdef BAO_STATS
+            atomic_add64(&cpu_if(i)->msg_stats.ipis, 1);
+#endif
+        }
+    }
+
+    if (ipi_mask != 0) {
+        fence_sync_write();
+        interrupts_cpu_sendipi_mask(ipi_mask, IPI_CPU_MSG);
+    }
+}
+
 /*
     send message to target CPU
 */
 void cpu_send_msg(uint64_t trgtcpu, cpu_msg_t *msg)
 {
-    cpu_msg_node_t *node = objcache_alloc(&msg_cache);
-    if (node == NULL) ERROR("cant allocate msg node");
-    node->msg = *msg;
-    list_push(&cpu_if(trgtcpu)->event_list, (node_t *)node); // 共享的消息區插入消息
-    fence_sync_write();
-    interrupts_cpu_sendipi(trgtcpu, IPI_CPU_MSG);
+    cpu_send_msg_mask(1ULL << trgtcpu, msg);
 }
 
 bool cpu_get_msg(cpu_msg_t *msg)
 {
     cpu_msg_node_t *node = NULL;
-    if ((node = (cpu_msg_node_t *)list_pop(&cpu.interface.event_list)) !=
+
+    if (cpu_msg_ring_pop(&cpu.interface, msg)) {
+        return true;
+    }
+
+    if ((node = (cpu_msg_node_t *)list_pop(&cpu.interface.msg_overflow)) !=
         NULL) {
         *msg = node->msg;
         objcache_free(&msg_cache, node);
@@ -84,17 +199,212 @@ bool cpu_get_msg(cpu_msg_t *msg)
     return false;
 }
 
+#ifdef BAO_STATS
+/**
+ * Measures the message throughput from the master cpu to another one. The
+ * receiver polls for the messages instead of taking the IPIs, which are left
+ * pending and later find no messages. The sender waits for the receiver to
+ * drain the ring before it gets full, so only the ring is measured, not the
+ * overflow list. Must be called by all cpus.
+ */
+#define CPU_MSG_BENCH_NUM (10000)
+
+void cpu_msg_bench()
+{
+    uint64_t rcv_cpu = (CPU_MASTER + 1) % platform.cpu_num;
+
+    if (platform.cpu_num < 2) return;
+
+    cpuif_t *rcv_if = cpu_if(rcv_cpu);
+    uint64_t overflows = rcv_if->msg_stats.overflows;
+    uint64_t ipis = rcv_if->msg_stats.ipis;
+
+    cpu_sync_barrier(&cpu_glb_sync);
+
+    if (cpu.id == CPU_MASTER) {
+        cpu_msg_t msg = {.handler = (uint32_t)-1, .event = 0};
+        for (size_t i = 0; i < CPU_MSG_BENCH_NUM; i++) {
+            while ((rcv_if->msg_head - rcv_if->msg_tail) >= CPU_MSG_RING_SIZE);
+            msg.data = i;
+            cpu_send_msg(rcv_cpu, &msg);
+        }
+    } else if (cpu.id == rcv_cpu) {
+        cpu_msg_t msg;
+        size_t n = 0;
+        uint64_t start = timer_get();
+        while (n < CPU_MSG_BENCH_NUM) {
+            if (cpu_get_msg(&msg)) n++;
+        }
+        uint64_t us = max(timer_ticks_to_us(timer_get() - start), 1UL);
+        INFO("cpu msg: %ld messages from cpu %ld in %ld us (%ld msgs/s)", n,
+             CPU_MASTER, us, (n * 1000000) / us);
+        INFO("cpu msg: %ld overflowed, %ld ipis raised",
+             rcv_if->msg_stats.overflows - overflows,
+             rcv_if->msg_stats.ipis - ipis);
+    }
+
+    cpu_sync_barrier(&cpu_glb_sync);
+}
+#endif
+
+/**
+ * Measures the global barrier's latency on all cpus, reported by the master
+ * as the average time per barrier. Must be called by all cpus.
+ */
+#define CPU_SYNC_BENCH_NUM (1000)
+
+void cpu_sync_bench()
+{
+    cpu_sync_barrier(&cpu_glb_sync);
+
+    uint64_t start = timer_get();
+    for (size_t i = 0; i < CPU_SYNC_BENCH_NUM; i++) {
+        cpu_sync_barrier(&cpu_glb_sync);
+    }
+    uint64_t ns = (timer_ticks_to_us(timer_get() - start) * 1000) /
+                  CPU_SYNC_BENCH_NUM;
+
+    if (cpu.id == CPU_MASTER) {
+        INFO("cpu sync: %ld cpus, %ld ns per barrier", platform.cpu_num, ns);
+    }
+}
+
+void cpu_lock_stats_report()
+{
+    static const char *const names[SPINLOCK_CLASS_NUM] = {
+        [SPINLOCK_CLASS_PAGE_POOL] = "page pool",
+        [SPINLOCK_CLASS_OBJCACHE] = "objcache",
+        [SPINLOCK_CLASS_VIRQ] = "virq",
+    };
+
+    for (size_t i = 0; i < SPINLOCK_CLASS_NUM; i++) {
+        INFO("cpu %ld %s locks: %ld taken, %ld contended", cpu.id, names[i],
+             cpu.lock_stats[i].acqs, cpu.lock_stats[i].contended);
+    }
+}
+
+static void cpu_msg_dispatch(cpu_msg_t *msg)
+{
+    if (msg->handler < ipi_cpumsg_handler_num &&
+        ipi_cpumsg_handlers[msg->handler]) {
+        ipi_cpumsg_handlers[msg->handler](msg->event, msg->data);
+    }
+}
+
+static void cpu_call_put(cpu_call_t *call)
+{
+    if (atomic_sub64(&call->refs, 1) == 0) {
+        objcache_free(&call_cache, call);
+    }
+}
+
+static void cpu_call_handler(uint32_t event, uint64_t data)
+{
+    cpu_call_t *call = (cpu_call_t *)data;
+
+    cpu_msg_dispatch(&call->msg);
+    cpu_call_put(call);
+}
+CPU_MSG_HANDLER(cpu_call_handler, CPU_CALL_ID);
+
+/**
+ * Run msg's handler on all cpus in the mask and return the call to wait on
+ * with cpu_call_wait. If the calling cpu is in the mask, the handler runs
+ * locally, after the remote cpus were signaled.
+ */
+cpu_call_t *cpu_call_async(uint64_t cpu_mask, cpu_msg_t *msg)
+{
+    cpu_call_t *call = objcache_alloc(&call_cache);
+    uint64_t remote_mask = cpu_mask & ~(1ULL << cpu.id);
+    uint64_t n = 1;
+
+    if (call == NULL) ERROR("cant allocate cpu call");
+
+    for (size_t i = 0; i < platform.cpu_num; i++) {
+        if (remote_mask & (1ULL << i)) n++;
+    }
+
+    call->msg = *msg;
+    call->refs = n;
+    fence_ord_write();
+
+    if (n > 1) {
+        cpu_msg_t call_msg = {
+            .handler = CPU_CALL_ID,
+            .event = 0,
+            .data = (uint64_t)call,
+        };
+        cpu_send_msg_mask(remote_mask, &call_msg);
+    }
+
+    if (cpu_mask & (1ULL << cpu.id)) {
+        cpu_msg_dispatch(&call->msg);
+    }
+
+    return call;
+}
+
+bool cpu_call_done(cpu_call_t *call)
+{
+    if (call->refs == 1) {
+        /* the targets' side effects must be seen after their completion */
+        fence_ord_read();
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Wait for all targets to run the call and release it. Meanwhile, messages
+ * sent to this cpu are handled, so that cpus calling each other don't
+ * deadlock. With a timeout, e.g. when serving a real-time vm, the wait gives
+ * up after timeout_us and returns false. The targets still run the handler
+ * later on, so it must not depend on the caller's state.
+ */
+bool cpu_call_wait(cpu_call_t *call, uint64_t timeout_us)
+{
+    uint64_t start = timer_get();
+    bool done = false;
+
+    while (!(done = cpu_call_done(call))) {
+        if (cpu.interface.msg_ipi_pending) {
+            cpu_msg_handler();
+        }
+        if (timeout_us != CPU_CALL_NO_TIMEOUT &&
+            timer_ticks_to_us(timer_get() - start) >= timeout_us) {
+            break;
+        }
+    }
+
+    cpu_call_put(call);
+
+    return done;
+}
+
+bool cpu_call(uint64_t cpu_mask, cpu_msg_t *msg, uint64_t timeout_us)
+{
+    return cpu_call_wait(cpu_call_async(cpu_mask, msg), timeout_us);
+}
+
 /*
     获取消息，并调用消息中的函数指针
 */
 void cpu_msg_handler()
 {
     cpu_msg_t msg;
+
+    /**
+     * Messages sent from now on need a new IPI. The ones sent before are
+     * handled below.
+     */
+    cpu.interface.msg_ipi_pending = 0;
+    fence_ord();
+
     while (cpu_get_msg(&msg)) {
-        if (msg.handler < ipi_cpumsg_handler_num &&
-            ipi_cpumsg_handlers[msg.handler]) {
-            ipi_cpumsg_handlers[msg.handler](msg.event, msg.data);
-        }
+        TRACE(TRACE_MSG_RECV, msg.data,
+              ((uint64_t)msg.handler << 32) | msg.event);
+        cpu_msg_dispatch(&msg);
     }
 }
 
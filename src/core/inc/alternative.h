@@ -0,0 +1,49 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#ifndef __ALTERNATIVE_H__
+#define __ALTERNATIVE_H__
+
+#include <bao.h>
+#include <arch/alternative.h>
+
+/**
+ * Code sequences are specialized once at boot for the optional features of
+ * the cpus, which are assumed to be the same on all of them. Each
+ * ALTERNATIVE site adds an entry to .alternatives.
+ */
+typedef struct {
+    uint64_t orig;
+    uint64_t repl;
+    uint16_t feature;
+    uint8_t orig_len;
+    uint8_t repl_len;
+    uint32_t pad;
+} alt_entry_t;
+
+extern uint64_t cpu_features;
+
+static inline bool cpu_has_feature(uint64_t feat)
+{
+    return (cpu_features >> feat) & 1;
+}
+
+void alternatives_init(uint64_t cpu_id);
+
+uint64_t alternatives_arch_detect();
+void alternatives_arch_sync(void* addr, size_t size);
+void alternatives_arch_sync_local();
+
+#endif /* __ALTERNATIVE_H__ */
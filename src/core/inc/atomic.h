@@ -0,0 +1,26 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#ifndef __ATOMIC_H__
+#define __ATOMIC_H__
+
+#include <arch/atomic.h>
+
+static inline uint64_t atomic_sub64(volatile uint64_t* ptr, uint64_t val)
+{
+    return atomic_add64(ptr, -val);
+}
+
+#endif /* __ATOMIC_H__ */
@@ -79,6 +79,23 @@ typedef struct vm_config {
      */
     uint64_t colors;
 
+    /**
+     * A window of the VM's address space where it can claim pages released
+     * by other VMs through the balloon hypercall, and the max number of pages
+     * it can hold on top of its memory regions.
+     */
+    struct {
+        uint64_t base;
+        size_t size;
+        size_t quota;
+    } balloon;
+
+    /**
+     * Allows the VM to read the exit statistics of all vcpus through the
+     * stats hypercall. Otherwise, it only gets those of its own vcpus.
+     */
+    bool stats_monitor;
+
     /**
      * A description of the virtual platform available to the guest, i.e.,
      * the virtual machine itself.
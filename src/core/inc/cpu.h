@@ -23,6 +23,9 @@
 #include <spinlock.h>
 #include <mem.h>
 #include <list.h>
+#include <objcache.h>
+#include <atomic.h>
+#include <fences.h>
 
 #define STACK_SIZE (PAGE_SIZE)
 
@@ -31,7 +34,40 @@
 extern uint8_t _cpu_if_base;
 
 typedef struct {
-    list_t event_list;
+    uint32_t handler;
+    uint32_t event;
+    uint64_t data;
+} cpu_msg_t;
+
+/**
+ * Messages to a cpu are passed in a bounded multi-producer single-consumer
+ * ring in its interface page. Each slot's sequence number tells whether it
+ * is free for the producer that reserved that position (seq == pos) or holds
+ * a message ready for the consumer (seq == pos + 1). If the ring is full,
+ * messages spill to a locked overflow list. While msg_ipi_pending is set, an
+ * IPI was raised and the cpu did not start handling it yet, so senders don't
+ * raise another one.
+ */
+#define CPU_MSG_RING_SIZE (64)
+
+typedef struct {
+    volatile uint64_t seq;
+    cpu_msg_t msg;
+} cpu_msg_slot_t;
+
+typedef struct {
+    volatile uint64_t msg_head;
+    volatile uint64_t msg_tail;
+    volatile uint64_t msg_ipi_pending;
+    cpu_msg_slot_t msg_ring[CPU_MSG_RING_SIZE];
+    list_t msg_overflow;
+#ifdef BAO_STATS
+    /* messages that spilled to the overflow list and IPIs raised */
+    struct {
+        volatile uint64_t overflows;
+        volatile uint64_t ipis;
+    } msg_stats;
+#endif
 
 } __attribute__((aligned(PAGE_SIZE))) cpuif_t;
 
@@ -40,6 +76,10 @@ typedef struct vcpu vcpu_t;
 typedef struct cpu {
     uint64_t id;
     addr_space_t as;
+    pp_mag_t page_mag;
+    objcache_mag_t oc_mags[OBJCACHE_MAG_NUM];
+    spinlock_stats_t lock_stats[SPINLOCK_CLASS_NUM];
+    uint64_t trace_head;
 
     vcpu_t* vcpu;
 
@@ -57,14 +97,36 @@ typedef struct cpu {
 
 extern cpu_t cpu;
 
-typedef struct {
-    uint32_t handler;
-    uint32_t event;
-    uint64_t data;
-} cpu_msg_t;
+/**
+ * Take a lock of a profiled class. It is counted as contended if it was
+ * found held before trying to acquire it.
+ */
+static inline void spin_lock_class(spinlock_t* lock, spinlock_class_t cls)
+{
+#ifdef BAO_STATS
+    cpu.lock_stats[cls].acqs++;
+    if (spin_is_locked(lock)) {
+        cpu.lock_stats[cls].contended++;
+    }
+#endif
+    spin_lock(lock);
+}
 
 void cpu_send_msg(uint64_t cpu, cpu_msg_t* msg);
 
+/**
+ * A cross-call runs a message handler on a set of cpus and tracks its
+ * completion. The call lives in global memory and holds a reference for each
+ * target plus one for the caller. Whoever drops the last one frees it, so the
+ * caller may stop waiting before the targets are done.
+ */
+typedef struct {
+    cpu_msg_t msg;
+    volatile uint64_t refs;
+} cpu_call_t;
+
+#define CPU_CALL_NO_TIMEOUT (0)
+
 typedef void (*cpu_msg_handler_t)(uint32_t event, uint64_t data);
 
 #define CPU_MSG_HANDLER(handler, handler_id)                    \
@@ -73,49 +135,70 @@ typedef void (*cpu_msg_handler_t)(uint32_t event, uint64_t data);
     __attribute__((section(".ipi_cpumsg_handlers_id"),          \
                    used)) volatile const uint64_t handler_id;
 
+/**
+ * Sense-reversing barrier. Each cpu flips its view of the sense before
+ * arriving, and the last cpu to arrive resets the count and publishes the new
+ * sense, releasing the others, which wait for it in low power.
+ */
 typedef struct {
-    spinlock_t lock;
     volatile uint64_t n;
     volatile bool ready;
     volatile uint64_t count;
+    volatile uint64_t sense;
 } cpu_synctoken_t;
 
 extern cpu_synctoken_t cpu_glb_sync;
 
 static inline void cpu_sync_init(cpu_synctoken_t* token, uint64_t n)
 {
-    token->lock = SPINLOCK_INITVAL;
     token->n = n;
     token->count = 0;
+    token->sense = 0;
+    fence_ord_write();
     token->ready = true;
 }
 
 static inline void cpu_sync_barrier(cpu_synctoken_t* token)
 {
-    // TODO: no fence/barrier needed in this function?
-
-    uint64_t next_count = 0;
+    uint64_t sense;
 
     while (!token->ready);
-
-    spin_lock(&token->lock);
-    token->count++;
-    next_count = ALIGN(token->count, token->n);
-    spin_unlock(&token->lock);
-
-    while (token->count < next_count);
+    fence_ord_read();
+
+    /**
+     * The sense can't flip before this cpu arrives, so it can be read ahead
+     * of the increment.
+     */
+    sense = !token->sense;
+
+    if (atomic_add64(&token->count, 1) == token->n) {
+        token->count = 0;
+        fence_ord();
+        token->sense = sense;
+        atomic_wake();
+    } else {
+        atomic_wait_ne64(&token->sense, !sense);
+    }
 }
 
 static inline cpuif_t* cpu_if(uint64_t cpu_id)
 {
-    return ((void*)&_cpu_if_base) +
-           (cpu_id * ALIGN(sizeof(cpuif_t), PAGE_SIZE));
+    return (cpuif_t*)((uintptr_t)&_cpu_if_base +
+                      (cpu_id * ALIGN(sizeof(cpuif_t), PAGE_SIZE)));
 }
 
 void cpu_init(uint64_t cpu_id, uint64_t load_addr);
 void cpu_send_msg(uint64_t cpu, cpu_msg_t* msg);
+void cpu_send_msg_mask(uint64_t cpu_mask, cpu_msg_t* msg);
 bool cpu_get_msg(cpu_msg_t* msg);
 void cpu_msg_handler();
+void cpu_msg_bench();
+void cpu_sync_bench();
+void cpu_lock_stats_report();
+cpu_call_t* cpu_call_async(uint64_t cpu_mask, cpu_msg_t* msg);
+bool cpu_call_done(cpu_call_t* call);
+bool cpu_call_wait(cpu_call_t* call, uint64_t timeout_us);
+bool cpu_call(uint64_t cpu_mask, cpu_msg_t* msg, uint64_t timeout_us);
 void cpu_msg_set_handler(uint64_t id, cpu_msg_handler_t handler);
 void cpu_idle();
 void cpu_idle_wakeup();
@@ -18,7 +18,9 @@
 
 enum {
     HC_INVAL = 0,
-    HC_IPC = 1
+    HC_IPC = 1,
+    HC_BALLOON = 2,
+    HC_STATS = 3
 };
 
 enum {
@@ -29,6 +29,7 @@ void interrupts_init();
 void interrupts_reserve(uint64_t int_id, irq_handler_t handler);
 
 void interrupts_cpu_sendipi(uint64_t target_cpu, uint64_t ipi_id);
+void interrupts_cpu_sendipi_mask(uint64_t cpu_mask, uint64_t ipi_id);
 void interrupts_cpu_enable(uint64_t int_id, bool en);
 
 bool interrupts_check(uint64_t int_id);
@@ -47,6 +48,7 @@ void interrupts_arch_enable(uint64_t int_id, bool en);
 bool interrupts_arch_check(uint64_t int_id);
 void interrupts_arch_clear(uint64_t int_id);
 void interrupts_arch_ipi_send(uint64_t cpu_target, uint64_t ipi_id);
+void interrupts_arch_ipi_send_mask(uint64_t cpu_mask, uint64_t ipi_id);
 void interrupts_arch_vm_assign(vm_t *vm, uint64_t id);
 void interrupts_arch_vm_inject(vm_t *vm, uint64_t id);
 bool interrupts_arch_conflict(bitmap_t interrupt_bitmap, uint64_t id);
@@ -38,12 +38,54 @@ enum AS_SEC {
     SEC_VM_ANY = 0, /* must be last */
 };
 
+/**
+ * Free virtual address ranges of a hypervisor section, kept as sorted extents.
+ * Once built, it is the only record of which addresses are free: the page
+ * tables of the section don't mark its allocations as reserved. Ranges that
+ * do not fit are dropped with a warning, leaking their addresses rather than
+ * ever handing out used ones.
+ */
+#define VS_MAX_EXTS (32)
+
+typedef struct {
+    bool ready;
+    size_t num;
+    struct {
+        uint64_t base;
+        uint64_t size;
+    } ext[VS_MAX_EXTS];
+} vspace_t;
+
+/**
+ * Reserve of zeroed pages for the page tables of a vm address space, so that
+ * tables are not zeroed while holding its lock. Refilled in batches.
+ */
+#define PT_RSV_SIZE (16)
+#define PT_RSV_BATCH (8)
+
+typedef struct {
+    size_t num;
+    uint64_t pages[PT_RSV_SIZE];
+    bool refilling;
+    struct {
+        uint64_t pt_pages;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t refills;
+        uint64_t reclaimed;
+    } stats;
+} pt_rsv_t;
+
 typedef struct {
     page_table_t pt;
     enum AS_TYPE type;
     uint64_t colors;
     uint64_t id;
     spinlock_t lock;
+    pt_rsv_t pt_rsv;
+    vspace_t priv_vs;
+    /* free ranges of the hypervisor sections are tracked in vspaces */
+    bool vs_enabled;
 } addr_space_t;
 
 typedef struct {
@@ -58,6 +100,7 @@ struct mem_region {
     uint64_t colors;
     bool place_phys;
     uint64_t phys;
+    bool lazy;
 };
 
 struct dev_region {
@@ -75,8 +118,45 @@ typedef struct shmem {
     bool place_phys;
     uint64_t phys;
     uint64_t cpu_masters;
+    /* Holds the hypervisor's trace rings, see trace.h */
+    bool trace;
 } shmem_t;
 
+/**
+ * Per-CPU cache of free single physical pages of the hypervisor's color set,
+ * kept in front of the page pools.
+ */
+#define PP_MAG_SIZE (32)
+
+typedef struct {
+    bool enabled;
+    bool draining;
+    uint64_t colors;
+    size_t count;
+    uint64_t pages[PP_MAG_SIZE];
+    struct {
+        uint64_t alloc_hits;
+        uint64_t alloc_misses;
+        uint64_t free_hits;
+        uint64_t refills;
+        uint64_t drains;
+    } stats;
+} pp_mag_t;
+
+/**
+ * Pending copy of the uncolored pages of an image being recolored. The image
+ * is mapped by mem_map_reclr_start, the copy may be split in parts run by
+ * different CPUs, and mem_map_reclr_finish releases what is left.
+ */
+typedef struct {
+    ppages_t ppages;
+    uint64_t colors;
+    uint64_t clr_offset;
+    void* phys_va;
+    void* reclrd_va;
+    size_t reclrd_num;
+} mem_reclr_t;
+
 static inline ppages_t mem_ppages_get(uint64_t base, uint64_t size)
 {
     return (ppages_t){.colors = 0, .base = base, .size = size};
@@ -96,14 +176,26 @@ void as_init(addr_space_t* as, enum AS_TYPE type, uint64_t id, void* root_pt,
              uint64_t colors);
 void* mem_alloc_page(size_t n, enum AS_SEC sec, bool phys_aligned);
 ppages_t mem_alloc_ppages(uint64_t colors, size_t n, bool aligned);
+ppages_t mem_alloc_ppages_aligned(uint64_t colors, size_t n, size_t align);
+size_t mem_blk_align(uint64_t ipa, size_t n);
+ppages_t mem_ppages_offset(ppages_t* ppages, size_t offset, size_t n);
 void* mem_alloc_vpage(addr_space_t* as, enum AS_SEC section, void* at,
                       size_t n);
 void mem_free_vpage(addr_space_t* as, void* at, size_t n, bool free_ppages);
+void mem_unmap(addr_space_t* as, void* at, size_t n, bool free_ppages);
 int mem_map(addr_space_t* as, void* va, ppages_t* ppages, size_t n,
             uint64_t flags);
 int mem_map_reclr(addr_space_t* as, void* va, ppages_t* ppages, size_t n,
                   uint64_t flags);
+int mem_map_reclr_start(mem_reclr_t* reclr, addr_space_t* as, void* va,
+                        ppages_t* ppages, size_t n, uint64_t flags);
+void mem_map_reclr_copy(mem_reclr_t* reclr, size_t part, size_t parts);
+void mem_map_reclr_finish(mem_reclr_t* reclr);
 int mem_map_dev(addr_space_t* as, void* va, uint64_t base, size_t n);
+void mem_stats_report();
+void mem_string_bench();
+void mem_pt_stats_report(addr_space_t* as);
+void mem_map_report(addr_space_t* as);
 
 /* Functions implemented in architecture dependent files */
 
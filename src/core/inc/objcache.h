@@ -25,6 +25,27 @@
 #define SLAB_MIN_HEADER_SIZE (32)
 #define SLAB_MAX_OBJECT_SIZE (PAGE_SIZE / 4)
 
+/* objcache_init flags */
+#define OBJCACHE_PRIME (1 << 0)  /* create the first slab right away */
+#define OBJCACHE_MAG (1 << 1)    /* keep per-CPU magazines of free objects */
+#define OBJCACHE_NOZERO (1 << 2) /* don't zero objects when they are freed */
+
+/**
+ * A magazine is a small per-CPU LIFO of free objects of one cache. Allocs
+ * and frees only take the cache lock to exchange a batch of objects with the
+ * slabs when it runs empty or full. Each CPU has a few of them, claimed by the
+ * first OBJCACHE_MAG caches it uses.
+ */
+#define OBJCACHE_MAG_SIZE (16)
+#define OBJCACHE_MAG_BATCH (OBJCACHE_MAG_SIZE / 2)
+#define OBJCACHE_MAG_NUM (2)
+
+/**
+ * Number of empty slabs a cache keeps before giving their pages back, so
+ * that alloc/free bursts around a slab boundary don't keep remapping it.
+ */
+#define OBJCACHE_EMPTY_MAX (1)
+
 struct objcache;
 typedef union slab slab_t;
 
@@ -34,10 +55,22 @@ typedef struct objcache {
     slab_t* last_free;
     spinlock_t lock;
     enum AS_SEC section;
+    uint64_t flags;
+    size_t empty;
 } objcache_t;
 
-void objcache_init(objcache_t* oc, size_t osize, enum AS_SEC sec, bool prime);
-void* objcache_alloc();
+typedef struct {
+    objcache_t* oc;
+    size_t count;
+    void* objs[OBJCACHE_MAG_SIZE];
+} objcache_mag_t;
+
+void objcache_init(objcache_t* oc, size_t osize, enum AS_SEC sec,
+                   uint64_t flags);
+void* objcache_alloc(objcache_t* oc);
 bool objcache_free(objcache_t* oc, void* obj);
+void objcache_std_init();
+void* objcache_std_alloc(size_t size);
+void objcache_std_free(void* obj, size_t size);
 
 #endif /* __OBJCACHE_H__ */
\ No newline at end of file
@@ -80,6 +80,42 @@ static inline bool pt_lvl_terminal(page_table_t* pt, size_t lvl)
 
 pte_t* pt_get_pte(page_table_t* pt, uint64_t lvl, void* va);
 pte_t* pt_get(page_table_t* pt, uint64_t lvl, void* va);
+
+/**
+ * A page table cursor iterates over the consecutive PTEs of a given level.
+ * PTEs of the same table are contiguous, so stepping to the next one is a
+ * pointer increment and the arch pt_get_pte is only called again when
+ * crossing into the next table. The cursor's pte is NULL when the table for
+ * its current va does not exist.
+ */
+typedef struct {
+    page_table_t* pt;
+    size_t lvl;
+    void* va;
+    pte_t* pte;
+} pt_cursor_t;
+
+static inline pte_t* pt_cursor_init(pt_cursor_t* cur, page_table_t* pt,
+                                    size_t lvl, void* va)
+{
+    cur->pt = pt;
+    cur->lvl = lvl;
+    cur->va = va;
+    cur->pte = pt_get_pte(pt, lvl, va);
+    return cur->pte;
+}
+
+static inline pte_t* pt_cursor_next(pt_cursor_t* cur)
+{
+    cur->va += pt_lvlsize(cur->pt, cur->lvl);
+    if ((cur->pte != NULL) &&
+        (pt_getpteindex_by_va(cur->pt, cur->va, cur->lvl) != 0)) {
+        cur->pte++;
+    } else {
+        cur->pte = pt_get_pte(cur->pt, cur->lvl, cur->va);
+    }
+    return cur->pte;
+}
 void pte_set(pte_t* pte, uint64_t addr, uint64_t type, uint64_t flags);
 
 void pte_set_rsw(pte_t* pte, uint64_t flag);
@@ -18,4 +18,26 @@
 
 #include <arch/spinlock.h>
 
+static inline bool spin_is_locked(spinlock_t* lock)
+{
+    uint32_t val = *lock;
+    return (val >> SPINLOCK_NEXT_SHIFT) != (val & SPINLOCK_OWNER_MSK);
+}
+
+/**
+ * Classes of locks whose contention is profiled by spin_lock_class when
+ * built with BAO_STATS.
+ */
+typedef enum {
+    SPINLOCK_CLASS_PAGE_POOL,
+    SPINLOCK_CLASS_OBJCACHE,
+    SPINLOCK_CLASS_VIRQ,
+    SPINLOCK_CLASS_NUM
+} spinlock_class_t;
+
+typedef struct {
+    uint64_t acqs;
+    uint64_t contended;
+} spinlock_stats_t;
+
 #endif /* __SPINLOCK_H__ */
\ No newline at end of file
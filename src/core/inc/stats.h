@@ -0,0 +1,124 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <bao.h>
+#include <cpu.h>
+#include <interrupts.h>
+#include <hypercall.h>
+#include <timer.h>
+#include <bit.h>
+
+/**
+ * Per vcpu exit statistics. As each physical cpu runs a single vcpu, there
+ * is one entry per cpu, written only by that cpu. Synchronous exits are
+ * counted by cause (ESR EC on armv8, scause on riscv), interrupts by id and
+ * hypercalls by id. Handler durations, in timer ticks, go to histograms with
+ * power of two buckets.
+ */
+#define STATS_SYNC_NUM (64)
+#define STATS_HC_NUM (8)
+#define STATS_HIST_NUM (32)
+
+#define STATS_NO_VM ((uint64_t)-1)
+
+enum { STATS_EXIT_SYNC, STATS_EXIT_IRQ, STATS_EXIT_NUM };
+
+typedef struct {
+    uint64_t vm_id;
+    uint64_t vcpu_id;
+    uint64_t sync[STATS_SYNC_NUM];
+    uint64_t hypercalls[STATS_HC_NUM];
+    uint64_t hist[STATS_EXIT_NUM][STATS_HIST_NUM];
+    uint32_t irqs[MAX_INTERRUPTS];
+} vcpu_stats_t;
+
+/**
+ * Header of the snapshot copied to the guest by the stats hypercall. It is
+ * followed by cpu_num entries of entry_size bytes. Only the entries of the
+ * cpus in cpu_mask are written.
+ */
+typedef struct {
+    uint64_t cpu_num;
+    uint64_t entry_size;
+    uint64_t cpu_mask;
+} stats_hdr_t;
+
+/**
+ * Without BAO_STATS the exit paths don't read the timer nor touch the table,
+ * and the stats hypercall is rejected.
+ */
+#ifdef BAO_STATS
+
+extern vcpu_stats_t* stats_table;
+
+void stats_init();
+void stats_vcpu_init(uint64_t vm_id, uint64_t vcpu_id);
+int64_t stats_hypercall(uint64_t arg0, uint64_t arg1, uint64_t arg2);
+
+static inline uint64_t stats_timestamp()
+{
+    return timer_get();
+}
+
+static inline void stats_hist_add(uint64_t type, uint64_t start)
+{
+    uint64_t ticks = timer_get() - start;
+    size_t bucket = 63 - bit_clz(ticks | 1);
+    stats_table[cpu.id].hist[type][min(bucket, STATS_HIST_NUM - 1)]++;
+}
+
+static inline void stats_sync_exit(uint64_t cause, uint64_t start)
+{
+    if (cause < STATS_SYNC_NUM) stats_table[cpu.id].sync[cause]++;
+    stats_hist_add(STATS_EXIT_SYNC, start);
+}
+
+static inline void stats_irq_exit(uint64_t int_id, uint64_t start)
+{
+    if (int_id < MAX_INTERRUPTS) stats_table[cpu.id].irqs[int_id]++;
+    stats_hist_add(STATS_EXIT_IRQ, start);
+}
+
+static inline void stats_hypercall_exit(uint64_t id)
+{
+    if (id < STATS_HC_NUM) stats_table[cpu.id].hypercalls[id]++;
+}
+
+#else
+
+static inline void stats_init() {}
+static inline void stats_vcpu_init(uint64_t vm_id, uint64_t vcpu_id) {}
+
+static inline int64_t stats_hypercall(uint64_t arg0, uint64_t arg1,
+                                      uint64_t arg2)
+{
+    return -HC_E_INVAL_ARGS;
+}
+
+static inline uint64_t stats_timestamp()
+{
+    return 0;
+}
+
+static inline void stats_sync_exit(uint64_t cause, uint64_t start) {}
+static inline void stats_irq_exit(uint64_t int_id, uint64_t start) {}
+static inline void stats_hypercall_exit(uint64_t id) {}
+
+#endif
+
+#endif /* STATS_H */
@@ -0,0 +1,40 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <bao.h>
+#include <arch/timer.h>
+
+static inline uint64_t timer_get()
+{
+    return timer_arch_get();
+}
+
+/**
+ * Converts a tick count to microseconds. Returns the raw tick count if the
+ * platform does not report the timer frequency.
+ */
+static inline uint64_t timer_ticks_to_us(uint64_t ticks)
+{
+    uint64_t freq = timer_arch_freq();
+    if (freq == 0) {
+        return ticks;
+    }
+    return (ticks / freq) * 1000000 + ((ticks % freq) * 1000000) / freq;
+}
+
+#endif /* __TIMER_H__ */
@@ -31,6 +31,16 @@ static inline void tlb_inv_va(addr_space_t *as, void *va)
     }
 }
 
+static inline void tlb_inv_range(addr_space_t *as, void *va, size_t size)
+{
+    if (as->type == AS_HYP) {
+        tlb_hyp_inv_range(va, size);
+    } else if (as->type == AS_VM) {
+        tlb_vm_inv_range(as->id, va, size);
+        // TODO: inval iommu tlbs
+    }
+}
+
 static inline void tlb_inv_all(addr_space_t *as)
 {
     if (as->type == AS_HYP) {
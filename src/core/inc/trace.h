@@ -0,0 +1,110 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <bao.h>
+#include <cpu.h>
+#include <timer.h>
+#include <fences.h>
+
+/**
+ * Static tracepoints, built in with BAO_TRACE. TRACE_EVENTS is a bitmap of
+ * the events to record, and the tracepoints of the others are compiled out.
+ * The event numbers and record layout are shared with
+ * tools/trace2json.py.
+ */
+enum trace_event {
+    TRACE_VM_EXIT,
+    TRACE_VM_ENTRY,
+    TRACE_IRQ_INJECT,
+    TRACE_LR_REFILL,
+    TRACE_LR_SPILL,
+    TRACE_MSG_SEND,
+    TRACE_MSG_RECV,
+    TRACE_IPC_HYPERCALL,
+    TRACE_EVENT_NUM
+};
+
+enum { TRACE_EXIT_SYNC, TRACE_EXIT_IRQ };
+
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS (~0ULL)
+#endif
+
+/**
+ * Each cpu records into its own ring, in a shared memory region marked as
+ * trace in the configuration, which a collector vm maps as any other ipc
+ * region. The region is split evenly among the cpus. The ring is overwritten
+ * when full. The head counts all records ever written and is published after
+ * each record, so a reader can drop the records overwritten while it copied
+ * them.
+ */
+#define TRACE_MAGIC (0x45434152544f4142ULL) /* "BAOTRACE" */
+
+typedef struct {
+    uint64_t ts;
+    uint64_t event;
+    uint64_t arg0;
+    uint64_t arg1;
+} trace_rec_t;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t cpu;
+    uint64_t rec_num;
+    uint64_t freq;
+    volatile uint64_t head;
+    uint64_t pad[3];
+    trace_rec_t recs[];
+} trace_ring_t;
+
+extern void* trace_base;
+extern size_t trace_ring_size;
+extern size_t trace_rec_num;
+
+void trace_init();
+
+static inline void trace_record(uint64_t event, uint64_t arg0, uint64_t arg1)
+{
+    if (trace_base == NULL) return;
+
+    /* the geometry and head are kept privately, as the vm can write them */
+    trace_ring_t* ring = trace_base + cpu.id * trace_ring_size;
+    trace_rec_t* rec = &ring->recs[cpu.trace_head % trace_rec_num];
+
+    rec->ts = timer_get();
+    rec->event = event;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+    fence_ord_write();
+    ring->head = ++cpu.trace_head;
+}
+
+#ifdef BAO_TRACE
+#define TRACE(event, arg0, arg1)                               \
+    do {                                                       \
+        if ((TRACE_EVENTS >> (event)) & 1) {                   \
+            trace_record((event), (arg0), (arg1));             \
+        }                                                      \
+    } while (0)
+#else
+#define TRACE(event, arg0, arg1) \
+    do {                         \
+    } while (0)
+#endif
+
+#endif /* TRACE_H */
@@ -32,6 +32,18 @@
 #include <iommu.h>
 #include <ipc.h>
 
+/**
+ * Lazily populated memory region. Its pages are reserved at boot, so that
+ * populating it can not fail, but only mapped and zeroed a chunk at a time
+ * on the first access to each chunk.
+ */
+typedef struct {
+    struct mem_region* reg;
+    ppages_t ppages;
+    /* chunks already mapped from the reserved pages */
+    bitmap_t populated;
+} vm_lazy_t;
+
 typedef struct vm {
     uint64_t id;
 
@@ -58,6 +70,18 @@ typedef struct vm {
 
     size_t ipc_num;
     ipc_t *ipcs;
+
+    size_t lazy_num;
+    vm_lazy_t* lazy;
+
+    int64_t balloon_pages;
+
+    struct {
+        void* src;
+        void* dst;
+        size_t size;
+        mem_reclr_t reclr;
+    } img_copy;
 } vm_t;
 
 typedef struct vcpu {
@@ -89,6 +113,11 @@ void vcpu_init(vcpu_t* vcpu, vm_t* vm, uint64_t entry);
 void vm_msg_broadcast(vm_t* vm, cpu_msg_t* msg);
 uint64_t vm_translate_to_pcpu_mask(vm_t* vm, uint64_t mask, size_t len);
 uint64_t vm_translate_to_vcpu_mask(vm_t* vm, uint64_t mask, size_t len);
+bool vm_mem_translate(vm_t* vm, uint64_t addr, uint64_t* pa);
+int vm_mem_map_zeroed(vm_t* vm, uint64_t addr, ppages_t* ppages, size_t n);
+bool vm_mem_is_lazy(vm_t* vm, uint64_t addr);
+bool vm_mem_is_ram(vm_t* vm, uint64_t addr);
+bool vm_mem_populate(vm_t* vm, uint64_t addr);
 
 static inline int64_t vm_translate_to_pcpuid(vm_t* vm, uint64_t vcpuid)
 {
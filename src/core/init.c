@@ -23,6 +23,7 @@
 #include <printk.h>
 #include <platform.h>
 #include <vmm.h>
+#include <alternative.h>
 
 void init(uint64_t cpu_id, uint64_t load_addr, uint64_t config_addr)
 {
@@ -30,6 +31,7 @@ void init(uint64_t cpu_id, uint64_t load_addr, uint64_t config_addr)
      * These initializations must be executed first and in fixed order.
      */
 
+    alternatives_init(cpu_id);
     cpu_init(cpu_id, load_addr);
     mem_init(load_addr, config_addr);
 
@@ -20,6 +20,7 @@
 #include <vm.h>
 #include <bitmap.h>
 #include <string.h>
+#include <stats.h>
 
 /*
     每个比特表示一个中断源
@@ -34,6 +35,11 @@ inline void interrupts_cpu_sendipi(uint64_t target_cpu, uint64_t ipi_id)
     interrupts_arch_ipi_send(target_cpu, ipi_id);
 }
 
+inline void interrupts_cpu_sendipi_mask(uint64_t cpu_mask, uint64_t ipi_id)
+{
+    interrupts_arch_ipi_send_mask(cpu_mask, ipi_id);
+}
+
 /* 
     给定中断ID，使能单个中断 
 */
@@ -78,13 +84,17 @@ inline void interrupts_vm_inject(vm_t *vm, uint64_t id)
 */
 enum irq_res interrupts_handle(uint64_t int_id)
 {
+    uint64_t start = stats_timestamp();
+
     if (vm_has_interrupt(cpu.vcpu->vm, int_id)) {
         interrupts_vm_inject(cpu.vcpu->vm, int_id);
+        stats_irq_exit(int_id, start);
 
         return FORWARD_TO_VM;
 
     } else if (interrupt_is_reserved(int_id)) {
         interrupt_handlers[int_id](int_id);
+        stats_irq_exit(int_id, start);
 
         return HANDLED_BY_HYP;
 
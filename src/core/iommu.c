@@ -37,7 +37,7 @@ void iommu_init()
 int iommu_vm_init(vm_t *vm, const vm_config_t *config)
 {
     objcache_init(&vm->iommu.dev_oc, sizeof(struct iommu_dev_node),
-                  SEC_HYP_GLOBAL, false);
+                  SEC_HYP_GLOBAL, 0);
 
     return iommu_arch_vm_init(vm, config);
 }
@@ -19,6 +19,7 @@
 #include <cpu.h>
 #include <vmm.h>
 #include <hypercall.h>
+#include <trace.h>
 
 enum {IPC_NOTIFY};
 
@@ -82,6 +83,8 @@ int64_t ipc_hypercall(uint64_t arg0, uint64_t arg1, uint64_t arg2)
     uint64_t ipc_event = arg1;
     int64_t ret = -HC_E_SUCCESS;
 
+    TRACE(TRACE_IPC_HYPERCALL, ipc_id, ipc_event);
+
     shmem_t *shmem = NULL; 
     bool valid_ipc_obj = ipc_id < cpu.vcpu->vm->ipc_num;
     if(valid_ipc_obj) {
@@ -99,12 +102,7 @@ int64_t ipc_hypercall(uint64_t arg0, uint64_t arg1, uint64_t arg2)
         };
         cpu_msg_t msg = {IPC_CPUSMG_ID, IPC_NOTIFY, data.raw};
 
-        // ???????????????????
-        for (int i = 0; i < platform.cpu_num; i++) {
-            if (ipc_cpu_masters & (1ULL << i)) {
-                cpu_send_msg(i, &msg); // TODO: why target CPU is i ???????
-            }
-        }
+        cpu_send_msg_mask(ipc_cpu_masters, &msg);
 
     } else {
         ret = -HC_E_INVAL_ARGS;
@@ -113,6 +111,25 @@ int64_t ipc_hypercall(uint64_t arg0, uint64_t arg1, uint64_t arg2)
     return ret;
 }
 
+/**
+ * Block alignment the shared memory backing needs so that every vm mapping
+ * it can do it with the largest blocks its ipc window allows.
+ */
+static size_t ipc_shmem_align(uint64_t shmem_id, size_t n_pg) {
+    size_t align = mem_blk_align(0, n_pg);
+    for (int i = 0; i < vm_config_ptr->vmlist_size; i++) {
+        vm_config_t *vm_config = &vm_config_ptr->vmlist[i];
+        for (int j = 0; j < vm_config->platform.ipc_num; j++) {
+            ipc_t *ipc = &vm_config->platform.ipcs[j];
+            if (ipc->shmem_id == shmem_id) {
+                size_t n = min(n_pg, NUM_PAGES(ipc->size));
+                align = min(align, mem_blk_align(ipc->base, n));
+            }
+        }
+    }
+    return align;
+}
+
 /*
     給每一塊共享内存，分配空間
 */
@@ -121,7 +138,8 @@ static void ipc_alloc_shmem() {
         shmem_t *shmem = &shmem_table[i];
         if(!shmem->place_phys) {
             size_t n_pg = NUM_PAGES(shmem->size);
-            ppages_t ppages = mem_alloc_ppages(shmem->colors, n_pg, false);
+            ppages_t ppages = mem_alloc_ppages_aligned(shmem->colors, n_pg,
+                ipc_shmem_align(i, n_pg));
             if(ppages.size < n_pg) {
                 ERROR("failed to allocate shared memory");
             }
@@ -166,6 +184,7 @@ void ipc_init(const vm_config_t* vm_config, bool vm_master) {
     
     if(cpu.id == CPU_MASTER) {
         ipc_alloc_shmem();
+        trace_init();
     }
 
     ipc_setup_masters(vm_config, vm_master);
@@ -27,6 +27,7 @@
 #include <vm.h>
 #include <fences.h>
 #include <tlb.h>
+#include <timer.h>
 
 extern uint8_t _image_start, _image_end, _dmem_phys_beg, _dmem_beg,
     _cpu_private_beg, _cpu_private_end, _vm_beg, _vm_end, _config_start,
@@ -44,6 +45,7 @@ typedef struct section {
     void *end;
     bool shared;
     spinlock_t lock;
+    vspace_t vs;
 } section_t;
 
 section_t hyp_secs[] = {
@@ -68,6 +70,32 @@ struct {
     [AS_VM] = {vm_secs, sizeof(vm_secs) / sizeof(struct section)},
 };
 
+/**
+ * Free pages are kept in binary buddy free lists, one per block order, so
+ * that naturally aligned power-of-two blocks can be found in O(log n). The
+ * bitmap remains the ownership record of each individual page. The list links
+ * and block orders live in per-page arrays placed right after the bitmap in
+ * the pool metadata region, as free physical pages are not necessarily mapped
+ * in the hypervisor address space.
+ */
+#define PP_MAX_ORDER (18)
+#define PP_ORDER_NONE (0xff)
+#define PP_LINK_NONE ((uint32_t)-1)
+
+/**
+ * Colors are given as a bitmask, so there can't be more than 64 of them. For
+ * each color the pool tracks how many of its pages are free and keeps a free
+ * page index: a bitmap with one bit per page of that color, in address order.
+ * Colored allocations skip pools that can't satisfy them and search the
+ * indexes of their colors a word at a time.
+ */
+#define PP_MAX_CLRS (sizeof(uint64_t) * 8)
+
+typedef struct {
+    uint32_t next;
+    uint32_t prev;
+} pp_link_t;
+
 typedef struct {
     node_t node;  // must be first element
     uint64_t base;
@@ -75,6 +103,12 @@ typedef struct {
     size_t free;
     size_t last;
     bitmap_t bitmap;
+    bitmap_t clr_bitmap;
+    size_t clr_size;
+    pp_link_t *blk_link;
+    uint8_t *blk_order;
+    uint32_t free_blks[PP_MAX_ORDER + 1];
+    size_t clr_free[PP_MAX_CLRS];
     spinlock_t lock;
 } page_pool_t;
 
@@ -84,219 +118,1211 @@ static objcache_t pagepool_cache;
 
 static bool config_found = false;
 
-static inline uint64_t pp_next_clr(uint64_t base, int from, uint64_t colors)
+static inline void pp_lock(page_pool_t *pool)
+{
+    spin_lock_class(&pool->lock, SPINLOCK_CLASS_PAGE_POOL);
+}
+
+static inline void pp_unlock(page_pool_t *pool)
+{
+    spin_unlock(&pool->lock);
+}
+
+static inline uint64_t pp_next_clr(uint64_t base, uint64_t from,
+                                   uint64_t colors)
 {
     uint64_t clr_offset = (base / PAGE_SIZE) % (COLOR_NUM * COLOR_SIZE);
     uint64_t index = from;
 
+    /* Skip whole color segments until one of the target colors is found */
     while (!((colors >> ((index + clr_offset) / COLOR_SIZE % COLOR_NUM)) & 1))
-        index++;
+        index += COLOR_SIZE - ((index + clr_offset) % COLOR_SIZE);
+
+    return index;
+}
+
+/* Number of pages left in the color segment of the page at index */
+static inline size_t pp_clr_seg_left(uint64_t base, uint64_t index)
+{
+    return COLOR_SIZE - (((base / PAGE_SIZE) + index) % COLOR_SIZE);
+}
+
+static inline size_t pp_bitmap_size(size_t n)
+{
+    return ALIGN(ALIGN(n, 8) / 8, sizeof(uint64_t));
+}
+
+/* Number of colors with their own free page counter and index */
+static inline size_t pp_clr_num()
+{
+    return min(COLOR_NUM, PP_MAX_CLRS);
+}
+
+/**
+ * Size in bits of each per-color index of a pool with n pages. It covers
+ * every color period the pool overlaps, including partial ones at its ends.
+ */
+static inline size_t pp_clr_bits(size_t n)
+{
+    return ((n / (COLOR_NUM * COLOR_SIZE)) + 2) * COLOR_SIZE;
+}
+
+/**
+ * Number of pages needed for the metadata of a pool with n pages: the page
+ * ownership bitmap and the per-color indexes followed by the buddy link and
+ * order arrays.
+ */
+static inline size_t pp_metadata_size(size_t n)
+{
+    return NUM_PAGES(pp_bitmap_size(n) +
+                     (pp_clr_num() * pp_bitmap_size(pp_clr_bits(n))) +
+                     (n * sizeof(pp_link_t)) + (n * sizeof(uint8_t)));
+}
+
+static inline uint64_t pp_pfn(page_pool_t *pool, size_t index)
+{
+    return (pool->base / PAGE_SIZE) + index;
+}
+
+static inline bitmap_t pp_clr_bitmap(page_pool_t *pool, size_t clr)
+{
+    size_t size = pp_bitmap_size(pool->clr_size) / sizeof(bitmap_granule_t);
+    return pool->clr_bitmap + (clr * size);
+}
+
+/**
+ * Position in the index of color clr of its first page at or after index.
+ * Positions count the pages of the color from the start of the color period
+ * where the pool begins.
+ */
+static inline size_t pp_clr_pos(page_pool_t *pool, size_t clr, size_t index)
+{
+    size_t period = COLOR_NUM * COLOR_SIZE;
+    uint64_t pfn = pp_pfn(pool, index);
+    size_t off = pfn % period;
+    size_t clr_off = clr * COLOR_SIZE;
+    size_t in_period = (off > clr_off) ? min(off - clr_off, COLOR_SIZE) : 0;
+
+    return (((pfn / period) - (pool->base / PAGE_SIZE / period)) * COLOR_SIZE) +
+           in_period;
+}
+
+static inline void pp_clr_update(page_pool_t *pool, size_t clr, size_t pos,
+                                 size_t n, bool free)
+{
+    if (free) {
+        bitmap_clear_consecutive(pp_clr_bitmap(pool, clr), pos, n);
+        pool->clr_free[clr] += n;
+    } else {
+        bitmap_set_consecutive(pp_clr_bitmap(pool, clr), pos, n);
+        pool->clr_free[clr] -= n;
+    }
+}
+
+/**
+ * Update the per-color free page counters and indexes for a range of pages
+ * that is being freed or allocated.
+ */
+static void pp_clr_account(page_pool_t *pool, size_t index, size_t n,
+                           bool free)
+{
+    if (n >= (COLOR_NUM * COLOR_SIZE)) {
+        /* The range spans every color, as a single run in each index */
+        for (size_t clr = 0; clr < pp_clr_num(); clr++) {
+            size_t pos = pp_clr_pos(pool, clr, index);
+            size_t len = pp_clr_pos(pool, clr, index + n) - pos;
+            pp_clr_update(pool, clr, pos, len, free);
+        }
+        return;
+    }
+
+    while (n > 0) {
+        size_t clr = (pp_pfn(pool, index) / COLOR_SIZE) % COLOR_NUM;
+        size_t len = min(n, pp_clr_seg_left(pool->base, index));
+        if (clr < PP_MAX_CLRS) {
+            pp_clr_update(pool, clr, pp_clr_pos(pool, clr, index), len, free);
+        }
+        index += len;
+        n -= len;
+    }
+}
+
+/* Smallest block order fitting n pages */
+static inline size_t pp_order(size_t n)
+{
+    size_t order = 0;
+    while ((order <= PP_MAX_ORDER) && ((1ULL << order) < n)) order++;
+    return order;
+}
+
+static void pp_blk_push(page_pool_t *pool, size_t index, size_t order)
+{
+    pp_link_t *link = &pool->blk_link[index];
+
+    link->prev = PP_LINK_NONE;
+    link->next = pool->free_blks[order];
+    if (link->next != PP_LINK_NONE) {
+        pool->blk_link[link->next].prev = index;
+    }
+    pool->free_blks[order] = index;
+    pool->blk_order[index] = order;
+}
+
+static void pp_blk_remove(page_pool_t *pool, size_t index)
+{
+    pp_link_t *link = &pool->blk_link[index];
+
+    if (link->prev != PP_LINK_NONE) {
+        pool->blk_link[link->prev].next = link->next;
+    } else {
+        pool->free_blks[pool->blk_order[index]] = link->next;
+    }
+    if (link->next != PP_LINK_NONE) {
+        pool->blk_link[link->next].prev = link->prev;
+    }
+    pool->blk_order[index] = PP_ORDER_NONE;
+}
+
+/**
+ * Insert a free block in the free lists, merging it with its buddy for as
+ * long as the buddy is also a free block of the same order.
+ */
+static void pp_blk_free(page_pool_t *pool, size_t index, size_t order)
+{
+    uint64_t base_pfn = pp_pfn(pool, 0);
+
+    while (order < PP_MAX_ORDER) {
+        uint64_t buddy_pfn = pp_pfn(pool, index) ^ (1ULL << order);
+        if (buddy_pfn < base_pfn) break;
+
+        size_t buddy = buddy_pfn - base_pfn;
+        if ((buddy + (1ULL << order) > pool->size) ||
+            (pool->blk_order[buddy] != order)) {
+            break;
+        }
+
+        pp_blk_remove(pool, buddy);
+        index = min(index, buddy);
+        order++;
+    }
+
+    pp_blk_push(pool, index, order);
+}
+
+/* Split a free range in the largest naturally aligned blocks possible */
+static void pp_blk_free_range(page_pool_t *pool, size_t index, size_t n)
+{
+    while (n > 0) {
+        uint64_t pfn = pp_pfn(pool, index);
+        size_t order = 0;
+        while ((order < PP_MAX_ORDER) && !(pfn & (1ULL << order)) &&
+               ((2ULL << order) <= n)) {
+            order++;
+        }
+        pp_blk_free(pool, index, order);
+        index += (1ULL << order);
+        n -= (1ULL << order);
+    }
+}
+
+/* Find the free block containing the page at index, if any */
+static int64_t pp_blk_find(page_pool_t *pool, size_t index)
+{
+    uint64_t base_pfn = pp_pfn(pool, 0);
+    uint64_t pfn = pp_pfn(pool, index);
+
+    for (size_t order = 0; order <= PP_MAX_ORDER; order++) {
+        uint64_t head_pfn = pfn & ~((1ULL << order) - 1);
+        if (head_pfn < base_pfn) break;
+        if (pool->blk_order[head_pfn - base_pfn] == order) {
+            return head_pfn - base_pfn;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Remove a range of pages from the free lists, giving back the parts of the
+ * enclosing free blocks that fall outside of it. Pages in the range that are
+ * not free are skipped.
+ */
+static void pp_blk_take_range(page_pool_t *pool, size_t index, size_t n)
+{
+    size_t top = index + n;
+
+    while (index < top) {
+        int64_t head = pp_blk_find(pool, index);
+        if (head < 0) {
+            index++;
+            continue;
+        }
+
+        size_t end = head + (1ULL << pool->blk_order[head]);
+        pp_blk_remove(pool, head);
+        pp_blk_free_range(pool, head, index - head);
+        if (end > top) {
+            pp_blk_free_range(pool, top, end - top);
+            end = top;
+        }
+        index = end;
+    }
+}
+
+/**
+ * Fetch a free block of the given order, splitting a bigger one if needed.
+ */
+static int64_t pp_blk_alloc(page_pool_t *pool, size_t order)
+{
+    size_t blk_order = order;
+
+    while ((blk_order <= PP_MAX_ORDER) &&
+           (pool->free_blks[blk_order] == PP_LINK_NONE)) {
+        blk_order++;
+    }
+    if (blk_order > PP_MAX_ORDER) return -1;
+
+    size_t index = pool->free_blks[blk_order];
+    pp_blk_remove(pool, index);
+    while (blk_order > order) {
+        blk_order--;
+        pp_blk_push(pool, index + (1ULL << blk_order), blk_order);
+    }
 
     return index;
 }
 
+/**
+ * Setup the pool metadata pointers on an already mapped region of
+ * pp_metadata_size pages and mark every page as free.
+ */
+static void pp_metadata_init(page_pool_t *pool, void *metadata)
+{
+    size_t bitmap_size = pp_bitmap_size(pool->size);
+    size_t clr_bitmap_size;
+
+    pool->clr_size = pp_clr_bits(pool->size);
+    clr_bitmap_size = pp_clr_num() * pp_bitmap_size(pool->clr_size);
+
+    pool->bitmap = metadata;
+    pool->clr_bitmap = metadata + bitmap_size;
+    pool->blk_link = metadata + bitmap_size + clr_bitmap_size;
+    pool->blk_order = (uint8_t *)(pool->blk_link + pool->size);
+
+    memset(pool->bitmap, 0, bitmap_size);
+    /* Pages of the color periods that fall outside the pool are never free */
+    memset(pool->clr_bitmap, 0xff, clr_bitmap_size);
+    memset(pool->blk_order, PP_ORDER_NONE, pool->size);
+    for (size_t i = 0; i <= PP_MAX_ORDER; i++) {
+        pool->free_blks[i] = PP_LINK_NONE;
+    }
+    for (size_t i = 0; i < PP_MAX_CLRS; i++) {
+        pool->clr_free[i] = 0;
+    }
+
+    pp_blk_free_range(pool, 0, pool->size);
+    pp_clr_account(pool, 0, pool->size, true);
+}
+
+/**
+ * Give back the allocated pages in a range to the pool. Only pages actually
+ * marked as allocated are returned to the free lists, so that a block is never
+ * inserted twice. Must be called with the pool lock held.
+ */
+static void pp_free_range(page_pool_t *pool, size_t index, size_t n)
+{
+    size_t top = index + n;
+
+    while (index < top) {
+        size_t count =
+            bitmap_count_consecutive(pool->bitmap, top, index, top - index);
+        if (bitmap_get(pool->bitmap, index)) {
+            bitmap_clear_consecutive(pool->bitmap, index, count);
+            pp_blk_free_range(pool, index, count);
+            pp_clr_account(pool, index, count, true);
+            pool->free += count;
+        }
+        index += count;
+    }
+}
+
 /*
     回收物理页：遍历page_pool_list，找到包含该物理页的page pool，然后清除对应的bitmap,实现回收
 */
-static void mem_free_ppages(ppages_t *ppages)
+static void pp_free_ppages(ppages_t *ppages)
 {
     list_foreach(page_pool_list, page_pool_t, pool)
     {
-        spin_lock(&pool->lock);
         if (in_range(ppages->base, pool->base, pool->size * PAGE_SIZE)) {
+            pp_lock(pool);
             uint64_t index = (ppages->base - pool->base) / PAGE_SIZE;
             if (!all_clrs(ppages->colors)) {
-                uint64_t index = 0;
-                for (int i = 0; i < ppages->size; i++) {
+                /* Free the pages one color segment at a time */
+                size_t left = ppages->size;
+                while (left > 0) {
                     index = pp_next_clr(pool->base, index, ppages->colors);
-                    bitmap_clear(pool->bitmap, index++);
+                    size_t n = min(left, pp_clr_seg_left(pool->base, index));
+                    pp_free_range(pool, index, n);
+                    index += n;
+                    left -= n;
                 }
             } else {
-                bitmap_clear_consecutive(pool->bitmap, index, ppages->size);
+                pp_free_range(pool, index, ppages->size);
+            }
+            pp_unlock(pool);
+        }
+    }
+}
+
+/**
+ * The target colors of an allocation. Their pages, in address order, make up
+ * the filtered color space a colored allocation must be contiguous in. It
+ * repeats every color period with a segment of COLOR_SIZE pages per color.
+ */
+typedef struct {
+    size_t num;
+    uint8_t clr[PP_MAX_CLRS];
+} pp_clr_set_t;
+
+/* Filtered position of the page at position pos of the i-th target color */
+static inline size_t pp_clr_set_q(pp_clr_set_t *set, size_t i, size_t pos)
+{
+    return ((((pos / COLOR_SIZE) * set->num) + i) * COLOR_SIZE) +
+           (pos % COLOR_SIZE);
+}
+
+/* Position of the first page of the i-th target color at or after q */
+static inline size_t pp_clr_set_pos(pp_clr_set_t *set, size_t i, size_t q)
+{
+    size_t seg = q / COLOR_SIZE;
+    size_t period = seg / set->num;
+
+    if ((seg % set->num) == i) {
+        return (period * COLOR_SIZE) + (q % COLOR_SIZE);
+    } else if ((seg % set->num) < i) {
+        return period * COLOR_SIZE;
+    } else {
+        return (period + 1) * COLOR_SIZE;
+    }
+}
+
+/* Pool index of the page at filtered position q */
+static inline size_t pp_clr_set_index(page_pool_t *pool, pp_clr_set_t *set,
+                                      size_t q)
+{
+    size_t period = COLOR_NUM * COLOR_SIZE;
+    size_t seg = q / COLOR_SIZE;
+    uint64_t pfn = (((pool->base / PAGE_SIZE / period) + (seg / set->num)) *
+                    period) +
+                   (set->clr[seg % set->num] * COLOR_SIZE) + (q % COLOR_SIZE);
+
+    return pfn - (pool->base / PAGE_SIZE);
+}
+
+/**
+ * Search the indexes of the target colors for n free pages contiguous in the
+ * filtered color space, for runs starting between q and end. Returns the
+ * start of the first such run or end if there is none.
+ */
+static size_t pp_clr_find(page_pool_t *pool, pp_clr_set_t *set, size_t q,
+                          size_t end, size_t n)
+{
+    /* Runs must also fit in the indexes */
+    size_t limit = min(end, (set->num * pool->clr_size) - n + 1);
+
+    while (q < limit) {
+        /* Move on to the first free page on any of the target colors */
+        size_t next = limit;
+        for (size_t i = 0; i < set->num; i++) {
+            int64_t pos =
+                bitmap_find_nth(pp_clr_bitmap(pool, set->clr[i]),
+                                pool->clr_size, 1, pp_clr_set_pos(set, i, q),
+                                false);
+            if (pos >= 0) {
+                next = min(next, pp_clr_set_q(set, i, pos));
+            }
+        }
+        q = next;
+        if (q >= limit) break;
+
+        /**
+         * The run is free if each target color is free over its share of
+         * it. Otherwise, restart past the allocated page found. If every
+         * run of n pages holds a page of that color, no run can start
+         * before the end of its allocated stretch either.
+         */
+        size_t skip = q;
+        for (size_t i = 0; i < set->num; i++) {
+            bitmap_t map = pp_clr_bitmap(pool, set->clr[i]);
+            size_t lo = pp_clr_set_pos(set, i, q);
+            size_t hi = pp_clr_set_pos(set, i, q + n);
+            if (lo >= hi) continue;
+
+            size_t count = 0;
+            if (!bitmap_get(map, lo)) {
+                count = bitmap_count_consecutive(map, hi, lo, hi - lo);
+            }
+            if (count == (hi - lo)) continue;
+
+            size_t taken = lo + count;
+            size_t restart = pp_clr_set_q(set, i, taken) + 1;
+            if (n > ((set->num - 1) * COLOR_SIZE)) {
+                int64_t pos =
+                    bitmap_find_nth(map, pool->clr_size, 1, taken, false);
+                if (pos < 0) return end;
+                restart = max(restart, pp_clr_set_q(set, i, pos - 1) + 1);
             }
+            skip = max(skip, restart);
         }
-        spin_unlock(&pool->lock);
+
+        if (skip == q) return q;
+        q = skip;
     }
+
+    return end;
 }
 
 static bool pp_alloc_clr(page_pool_t *pool, size_t n, uint64_t colors,
                          ppages_t *ppages)
 {
-    uint64_t allocated = 0;
-
-    uint64_t first_index = 0;
+    pp_clr_set_t set = { .num = 0 };
+    size_t clr_free = 0;
     bool ok = false;
 
     ppages->colors = colors;
     ppages->size = 0;
 
-    spin_lock(&pool->lock);
+    pp_lock(pool);
 
-    /**
-     * Lets start the search at the first available color after the last
-     * known free position to the top of the pool.
-     */
-    uint64_t index = pp_next_clr(pool->base, pool->last, colors);
-    uint64_t top = pool->size;
-
-    /**
-     * Two iterations. One starting from the last known free page,
-     * other starting from the beggining of page pool to the start of the
-     * previous iteration.
-     */
-    for (int i = 0; i < 2 && !ok; i++) {
-        while ((allocated < n) && (index < top)) {
-            allocated = 0;
-
-            /* Find first free page on the target colors */
-            while ((index < top) && bitmap_get(pool->bitmap, index)) {
-                index = pp_next_clr(pool->base, ++index, colors);
-            }
-            first_index = index;
+    /* Bail out early if the pool lacks free pages on the target colors */
+    for (size_t clr = 0; clr < pp_clr_num(); clr++) {
+        if (colors & (1ULL << clr)) {
+            clr_free += pool->clr_free[clr];
+            set.clr[set.num++] = clr;
+        }
+    }
 
-            /**
-             * Count the number of free pages contigous on the target
-             * color segement until n pages are found or we reach top page
-             * of the search.
-             */
-            while ((index < top) && (bitmap_get(pool->bitmap, index) == 0) &&
-                   (allocated < n)) {
-                allocated++;
-                index = pp_next_clr(pool->base, ++index, colors);
-            }
+    if ((n > 0) && (clr_free >= n)) {
+        /**
+         * Search from the last allocation up first, as the pages below it
+         * are likely taken, and only then from the bottom of the pool.
+         */
+        size_t top = set.num * pool->clr_size;
+        size_t last = top;
+        for (size_t i = 0; i < set.num; i++) {
+            size_t pos = pp_clr_pos(pool, set.clr[i], pool->last);
+            last = min(last, pp_clr_set_q(&set, i, pos));
+        }
 
-            index++;
+        size_t q = pp_clr_find(pool, &set, last, top, n);
+        if (q >= top) {
+            q = pp_clr_find(pool, &set, 0, last, n);
+            ok = (q < last);
+        } else {
+            ok = true;
         }
 
-        if (allocated == n) {
+        if (ok) {
             /**
-             * We've found n contigous free pages that fit the color pattern,
-             * Fill the output ppage arg, mark the pages as allocated and
-             * update page pool internal state.
+             * We've found n contigous free pages that fit the color
+             * pattern, Fill the output ppage arg, mark the pages as
+             * allocated and update page pool internal state.
              */
+            size_t index = pp_clr_set_index(pool, &set, q);
+            size_t left = n;
+
             ppages->size = n;
-            ppages->base = pool->base + (first_index * PAGE_SIZE);
-            for (int i = 0; i < n; i++) {
-                first_index = pp_next_clr(pool->base, first_index, colors);
-                bitmap_set(pool->bitmap, first_index++);
+            ppages->base = pool->base + (index * PAGE_SIZE);
+
+            while (left > 0) {
+                index = pp_next_clr(pool->base, index, colors);
+                size_t count = min(left, pp_clr_seg_left(pool->base, index));
+                pp_blk_take_range(pool, index, count);
+                bitmap_set_consecutive(pool->bitmap, index, count);
+                pp_clr_account(pool, index, count, false);
+                index += count;
+                left -= count;
             }
+
             pool->free -= n;
-            pool->last = first_index;
-            ok = true;
-            break;
-        } else {
-            /**
-             * If this is the first iteration, setup index and top to search
-             * from base of the page pool until the previous iteration start
-             * point
-             */
-            index = 0;
-            top = pool->last;
+            pool->last = index;
         }
     }
 
-    spin_unlock(&pool->lock);
+    pp_unlock(pool);
 
     return ok;
 }
 
+/* Lowest index not below index of a page physically aligned to align pages */
+static inline size_t pp_align_up(page_pool_t *pool, size_t index, size_t align)
+{
+    if (!align) return index;
+
+    size_t off = pp_pfn(pool, index) % align;
+    return (off == 0) ? index : index + (align - off);
+}
+
+/**
+ * Linear search on the pool bitmap for n contiguous free pages, physically
+ * aligned to align pages if align is not zero. Must be called with the pool
+ * lock held.
+ */
+static int64_t pp_search(page_pool_t *pool, size_t n, size_t align)
+{
+    /**
+     *  If we need an aligned contigous segment, lets start at an already
+     * aligned index.
+     */
+    size_t curr = pp_align_up(pool, pool->last, align);
+
+    /**
+     * Lets make two searches:
+     *  - one starting from the last known free index.
+     *  - in case this does not work, start from index 0.
+     */
+    for (int i = 0; i < 2; i++) {
+        while (pool->free != 0) {
+            int64_t bit =
+                bitmap_find_consec(pool->bitmap, pool->size, curr, n, false);
+
+            if (bit < 0) {
+                /**
+                 * No n page sement was found. If this is the first iteration
+                 * set position to 0 to start next search from index 0.
+                 */
+                curr = pp_align_up(pool, 0, align);
+                break;
+            } else if (pp_align_up(pool, bit, align) != bit) {
+                /**
+                 *  If we're looking for an aligned segment and the found
+                 * contigous segment is not aligned, start the search again
+                 * from the next aligned index
+                 */
+                curr = pp_align_up(pool, bit, align);
+            } else {
+                return bit;
+            }
+        }
+    }
+
+    return -1;
+}
+
 /*
     给定一个page pool，分配n个物理页，并置位对应的bitmap
 */
-static bool pp_alloc(page_pool_t *pool, size_t n, bool aligned,
+static bool pp_alloc(page_pool_t *pool, size_t n, size_t align,
                      ppages_t *ppages)
 {
     ppages->colors = 0;
     ppages->size = 0;
 
-    bool ok = false;
+    bool ok = false;
+    int64_t bit = -1;
+    size_t order = pp_order(max(n, align));
+
+    if (n == 0) return false;
+
+    pp_lock(pool);
+
+    if (order <= PP_MAX_ORDER) {
+        /**
+         * Take the smallest free block that fits the n pages and the
+         * alignment. As it is naturally aligned to its size, it also
+         * fulfills the alignment requirement. The unused tail of the block
+         * goes back to the free lists.
+         */
+        bit = pp_blk_alloc(pool, order);
+        if (bit >= 0) {
+            pp_blk_free_range(pool, bit + n, (1ULL << order) - n);
+        }
+    }
+
+    if (bit < 0) {
+        /**
+         * Segments bigger than the largest block, or segments only
+         * available across block boundaries, fall back to a linear search
+         * of the bitmap. An aligned segment may be free even without a
+         * whole free block of the rounded up order, e.g. when n is not a
+         * power of two or is bigger than align.
+         */
+        bit = pp_search(pool, n, align);
+        if (bit >= 0) {
+            pp_blk_take_range(pool, bit, n);
+        }
+    }
+
+    if (bit >= 0) {
+        /**
+         * We've found our pages. Fill output argument info, mark
+         * them as allocated, and update page pool bookkeeping.
+         */
+        ppages->base = pool->base + (bit * PAGE_SIZE);
+        ppages->size = n;
+        bitmap_set_consecutive(pool->bitmap, bit, n);
+        pp_clr_account(pool, bit, n, false);
+        pool->free -= n;
+        pool->last = bit + n;
+        ok = true;
+    }
+
+    pp_unlock(pool);
+
+    return ok;
+}
+
+/*
+    分配物理页：遍历page_pool_list，分配大小为n的物理页
+*/
+static ppages_t pp_alloc_ppages(uint64_t colors, size_t n, size_t align)
+{
+    ppages_t pages = {.size = 0};
+
+    list_foreach(page_pool_list, page_pool_t, pool)
+    {
+        bool ok = (!all_clrs(colors) && !align)
+                      ? pp_alloc_clr(pool, n, colors, &pages) // TODO:
+                      : pp_alloc(pool, n, align, &pages);
+        if (ok) break;
+    }
+
+    return pages;
+}
+
+/**
+ * Single page allocations and frees go through a per-CPU magazine of free
+ * pages, so that most of them don't need to take a pool lock. A magazine
+ * only holds pages of the hypervisor's color set, fixed in mem_init, and
+ * allocations for other color sets go straight to the pools. It is refilled
+ * from, and drained to, the pools in batches of half its size.
+ */
+#define PP_MAG_BATCH (PP_MAG_SIZE / 2)
+
+static inline uint64_t pp_mag_key(uint64_t colors)
+{
+    return all_clrs(colors) ? 0 : colors;
+}
+
+static void pp_mag_drain(pp_mag_t *mag, size_t n)
+{
+    mag->stats.drains++;
+
+    list_foreach(page_pool_list, page_pool_t, pool)
+    {
+        bool locked = false;
+        for (size_t i = mag->count - n; i < mag->count; i++) {
+            if (in_range(mag->pages[i], pool->base, pool->size * PAGE_SIZE)) {
+                if (!locked) {
+                    pp_lock(pool);
+                    locked = true;
+                }
+                pp_free_range(pool, (mag->pages[i] - pool->base) / PAGE_SIZE,
+                              1);
+            }
+        }
+        if (locked) pp_unlock(pool);
+    }
+
+    mag->count -= n;
+}
+
+static bool pp_mag_refill(pp_mag_t *mag, uint64_t colors)
+{
+    ppages_t pages = pp_alloc_ppages(colors, PP_MAG_BATCH, 0);
+    if (pages.size == 0) return false;
+
+    mag->stats.refills++;
+
+    uint64_t index = 0;
+    for (size_t i = 0; i < pages.size; i++) {
+        if (colors != 0) {
+            index = pp_next_clr(pages.base, index, colors);
+        }
+        mag->pages[mag->count++] = pages.base + (index * PAGE_SIZE);
+        index++;
+    }
+
+    return true;
+}
+
+static bool pp_mag_alloc(uint64_t colors, ppages_t *ppages)
+{
+    pp_mag_t *mag = &cpu.page_mag;
+    uint64_t key = pp_mag_key(colors);
+
+    if (!mag->enabled || (mag->colors != key)) return false;
+
+    if (mag->count > 0) {
+        mag->stats.alloc_hits++;
+    } else {
+        mag->stats.alloc_misses++;
+        if (!pp_mag_refill(mag, key)) return false;
+    }
+
+    *ppages = (ppages_t){
+        .base = mag->pages[--mag->count], .size = 1, .colors = key};
+
+    return true;
+}
+
+static bool pp_mag_free(ppages_t *ppages)
+{
+    pp_mag_t *mag = &cpu.page_mag;
+
+    if (!mag->enabled || (ppages->size != 1)) return false;
+
+    uint64_t base = ppages->base;
+    if (!all_clrs(ppages->colors)) {
+        base += pp_next_clr(base, 0, ppages->colors) * PAGE_SIZE;
+    }
+
+    /* The page may only join the magazine if its color is in its color set */
+    uint64_t clr = ((base / PAGE_SIZE) / COLOR_SIZE) % COLOR_NUM;
+    if ((mag->colors != 0) && !((mag->colors >> clr) & 1)) {
+        return false;
+    }
+
+    if (mag->count == PP_MAG_SIZE) {
+        pp_mag_drain(mag, PP_MAG_BATCH);
+    }
+
+    mag->stats.free_hits++;
+    mag->pages[mag->count++] = base;
+
+    return true;
+}
+
+/*
+    释放物理页：单页优先放回本CPU的magazine
+*/
+static void mem_free_ppages(ppages_t *ppages)
+{
+    if (!pp_mag_free(ppages)) {
+        pp_free_ppages(ppages);
+    }
+}
+
+static void pp_mag_drain_handler(uint32_t event, uint64_t data)
+{
+    pp_mag_t *mag = &cpu.page_mag;
+
+    if (mag->count > 0) {
+        pp_mag_drain(mag, mag->count);
+    }
+}
+CPU_MSG_HANDLER(pp_mag_drain_handler, PP_MAG_DRAIN_ID);
+
+/**
+ * Give back the pages cached in the magazines to the pools, the local one
+ * first and then everyone's. Returns false if there was nothing to reclaim.
+ * The cross-call allocates from an object cache which may itself run out of
+ * pages and get here again, hence the draining flag.
+ */
+#define PP_MAG_DRAIN_TIMEOUT_US (1000)
+
+static bool pp_mag_reclaim(bool remote)
+{
+    pp_mag_t *mag = &cpu.page_mag;
+
+    if (!mag->enabled || mag->draining) return false;
+
+    if (!remote) {
+        if (mag->count == 0) return false;
+        pp_mag_drain(mag, mag->count);
+        return true;
+    }
+
+    if (platform.cpu_num < 2) return false;
+
+    /**
+     * Other cpus might be spinning with interrupts masked for a while, so
+     * don't wait for them forever. Their magazines are drained later on
+     * anyway.
+     */
+    cpu_msg_t msg = {PP_MAG_DRAIN_ID, 0, 0};
+    mag->draining = true;
+    cpu_call(BIT_MASK(0, platform.cpu_num), &msg, PP_MAG_DRAIN_TIMEOUT_US);
+    mag->draining = false;
+
+    return true;
+}
+
+ppages_t mem_alloc_ppages(uint64_t colors, size_t n, bool aligned)
+{
+    ppages_t pages = {.size = 0};
+
+    if ((n == 1) && pp_mag_alloc(colors, &pages)) {
+        return pages;
+    }
+
+    pages = pp_alloc_ppages(colors, n, aligned ? n : 0);
+
+    /**
+     * The pages missing might be sitting in the magazines. Drain them and
+     * try again, without bothering the other cpus if the local magazine
+     * alone is enough.
+     */
+    for (size_t i = 0; (pages.size == 0) && (i < 2); i++) {
+        if (pp_mag_reclaim(i > 0)) {
+            pages = pp_alloc_ppages(colors, n, aligned ? n : 0);
+        }
+    }
+
+    return pages;
+}
+
+/**
+ * Largest block a vm stage-2 can map at ipa that still fits in n pages, in
+ * pages. Backing a mapping with memory aligned to it lets mem_map use the
+ * biggest block entries the ipa allows.
+ */
+size_t mem_blk_align(uint64_t ipa, size_t n)
+{
+    page_table_dscr_t *dscr = vm_pt_dscr;
+    size_t align = 1;
+
+    for (size_t lvl = 0; lvl < dscr->lvls; lvl++) {
+        uint64_t lvlsz = 1ULL << dscr->lvl_off[lvl];
+        if (dscr->lvl_term[lvl] && ((ipa % lvlsz) == 0) &&
+            (lvlsz <= n * PAGE_SIZE)) {
+            align = lvlsz / PAGE_SIZE;
+            break;
+        }
+    }
+
+    return align;
+}
+
+/**
+ * Allocates n contiguous pages aligned to align pages, falling back to
+ * unaligned pages if no such segment is free. Colored pages can't be
+ * aligned to anything bigger than a page.
+ */
+ppages_t mem_alloc_ppages_aligned(uint64_t colors, size_t n, size_t align)
+{
+    ppages_t pages = {.size = 0};
+
+    if (all_clrs(colors) && (align > 1)) {
+        pages = pp_alloc_ppages(colors, n, align);
+    }
+    if (pages.size < n) {
+        pages = mem_alloc_ppages(colors, n, false);
+    }
+
+    return pages;
+}
+
+/**
+ * Returns the n pages of ppages found after its first offset pages. For
+ * colored ppages, the pages of other colors in between are skipped.
+ */
+ppages_t mem_ppages_offset(ppages_t *ppages, size_t offset, size_t n)
+{
+    uint64_t index = offset;
+
+    if (!all_clrs(ppages->colors)) {
+        size_t left = offset;
+        index = pp_next_clr(ppages->base, 0, ppages->colors);
+        while (left >= pp_clr_seg_left(ppages->base, index)) {
+            left -= pp_clr_seg_left(ppages->base, index);
+            index += pp_clr_seg_left(ppages->base, index);
+            index = pp_next_clr(ppages->base, index, ppages->colors);
+        }
+        index += left;
+    }
+
+    return (ppages_t){.base = ppages->base + index * PAGE_SIZE,
+                      .size = n,
+                      .colors = ppages->colors};
+}
+
+#ifdef BAO_STATS
+/**
+ * Counts the valid leaf entries of the address space by their size and
+ * reports how many 4K, 2M and 1G mappings it has.
+ */
+void mem_map_report(addr_space_t *as)
+{
+    size_t num[3] = {0, 0, 0};
+    uint64_t top = pt_nentries(&as->pt, 0) * pt_lvlsize(&as->pt, 0);
+    uint64_t va = 0;
+
+    spin_lock(&as->lock);
+    while (va < top) {
+        uint64_t lvlsz = PAGE_SIZE;
+        for (size_t lvl = 0; lvl < as->pt.dscr->lvls; lvl++) {
+            pte_t *pte = pt_get_pte(&as->pt, lvl, (void *)va);
+            lvlsz = pt_lvlsize(&as->pt, lvl);
+            if (pte == NULL || !pte_valid(pte)) break;
+            if (!pte_table(&as->pt, pte, lvl)) {
+                for (size_t i = 0; i < 3; i++) {
+                    if (lvlsz == (PAGE_SIZE << (9 * i))) num[i]++;
+                }
+                break;
+            }
+        }
+        va = (va & ~(lvlsz - 1)) + lvlsz;
+    }
+    spin_unlock(&as->lock);
+
+    INFO("%s %ld mappings: %ld 4K, %ld 2M, %ld 1G",
+         as->type == AS_VM ? "vm" : "cpu", as->type == AS_VM ? as->id : cpu.id,
+         num[0], num[1], num[2]);
+}
+#endif
+
+void mem_stats_report()
+{
+    pp_mag_t *mag = &cpu.page_mag;
+
+    INFO("cpu %ld page magazine: %ld hits, %ld misses, %ld frees, "
+         "%ld refills, %ld drains",
+         cpu.id, mag->stats.alloc_hits, mag->stats.alloc_misses,
+         mag->stats.free_hits, mag->stats.refills, mag->stats.drains);
+}
+
+/**
+ * Measures the string routines' throughput on a hypervisor buffer, against
+ * plain byte loops as reference. The buffer is accessed through a volatile
+ * pointer in the loops so they are not turned into calls to the routines.
+ */
+#define MEM_BENCH_PAGES (64)
+
+static void mem_bench_report(const char *op, size_t size, uint64_t ref,
+                             uint64_t opt)
+{
+    INFO("%s: %ld MB/s (byte loop %ld MB/s)", op,
+         size / max(timer_ticks_to_us(opt), 1UL),
+         size / max(timer_ticks_to_us(ref), 1UL));
+}
+
+void mem_string_bench()
+{
+    size_t size = MEM_BENCH_PAGES * PAGE_SIZE;
+    uint8_t *buf = mem_alloc_page(2 * MEM_BENCH_PAGES, SEC_HYP_PRIVATE, false);
+    if (buf == NULL) return;
+    volatile uint8_t *src = buf;
+    volatile uint8_t *dst = buf + size;
+    uint64_t t[3];
+
+    t[0] = timer_get();
+    for (size_t i = 0; i < size; i++) dst[i] = 0;
+    t[1] = timer_get();
+    memset((void *)dst, 0, size);
+    t[2] = timer_get();
+    mem_bench_report("memset zero", size, t[1] - t[0], t[2] - t[1]);
+
+    t[0] = timer_get();
+    for (size_t i = 0; i < size; i++) src[i] = 0xa5;
+    t[1] = timer_get();
+    memset((void *)src, 0xa5, size);
+    t[2] = timer_get();
+    mem_bench_report("memset", size, t[1] - t[0], t[2] - t[1]);
+
+    t[0] = timer_get();
+    for (size_t i = 0; i < size; i++) dst[i] = src[i];
+    t[1] = timer_get();
+    memcpy((void *)dst, (void *)src, size);
+    t[2] = timer_get();
+    mem_bench_report("memcpy", size, t[1] - t[0], t[2] - t[1]);
+
+    t[0] = timer_get();
+    for (size_t i = 0; i < size && src[i] == dst[i]; i++);
+    t[1] = timer_get();
+    memcmp((void *)src, (void *)dst, size);
+    t[2] = timer_get();
+    mem_bench_report("memcmp", size, t[1] - t[0], t[2] - t[1]);
+
+    mem_free_vpage(&cpu.as, buf, 2 * MEM_BENCH_PAGES, true);
+}
+
+void mem_pt_stats_report(addr_space_t *as)
+{
+    pt_rsv_t *rsv = &as->pt_rsv;
+
+    INFO("%s %ld page tables: %ld pages, %ld reclaimed, %ld from zeroed "
+         "reserve, %ld zeroed inline, %ld reserve refills",
+         as->type == AS_VM ? "vm" : "cpu", as->type == AS_VM ? as->id : cpu.id,
+         rsv->stats.pt_pages, rsv->stats.reclaimed, rsv->stats.hits,
+         rsv->stats.misses, rsv->stats.refills);
+}
+
+/*
+    查虚拟地址位于哪个虚拟地址空间
+*/
+static section_t *mem_find_sec(addr_space_t *as, void *va)
+{
+    for (int i = 0; i < sections[as->type].sec_size; i++) {
+        if ((va >= sections[as->type].sec[i].beg) &&
+            (va <= sections[as->type].sec[i].end)) {
+            return &sections[as->type].sec[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Hypervisor sections keep their free ranges in a vspace_t once memory
+ * management is up, i.e., once the address space enables it. Shared sections
+ * keep it in the section, the cpu private section in the address space. The
+ * vm section is private to each vm but shared by its cpus, so it, and vm
+ * address spaces, keep walking the tables.
+ */
+static vspace_t *mem_vspace(addr_space_t *as, section_t *sec)
+{
+    if (!as->vs_enabled || as->type == AS_VM) return NULL;
+    if (sec == &hyp_secs[SEC_HYP_PRIVATE]) return &as->priv_vs;
+    if (sec == &hyp_secs[SEC_HYP_VM]) return NULL;
+    return &sec->vs;
+}
 
-    if (n == 0) return false;
+/* Index of the first extent ending after addr */
+static size_t vs_find(vspace_t *vs, uint64_t addr)
+{
+    size_t lo = 0, hi = vs->num;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (vs->ext[mid].base + vs->ext[mid].size <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    spin_lock(&pool->lock);
+static void vs_remove(vspace_t *vs, size_t i)
+{
+    for (size_t j = i; j + 1 < vs->num; j++) {
+        vs->ext[j] = vs->ext[j + 1];
+    }
+    vs->num--;
+}
 
-    /**
-     *  If we need a contigous segment aligned to its size, lets start
-     * at an already aligned index.
-     */
-    size_t start = aligned ?  n - (pool->base / PAGE_SIZE % n) : 0;
-    size_t curr = pool->last + ((pool->last + start) % n);
+/**
+ * Adds a free range at index i, merging it with the neighbouring extents it
+ * touches. If there is no room left, the smallest range is dropped, leaking
+ * its addresses rather than ever handing out used ones.
+ */
+static void vs_insert(vspace_t *vs, size_t i, uint64_t base, uint64_t size)
+{
+    bool prev = (i > 0) && (vs->ext[i - 1].base + vs->ext[i - 1].size == base);
+    bool next = (i < vs->num) && (vs->ext[i].base == base + size);
 
-    /**
-     * Lets make two searches:
-     *  - one starting from the last known free index.
-     *  - in case this does not work, start from index 0.
-     */
-    for (int i = 0; i < 2 && !ok; i++) {
-        while (pool->free != 0) {
-            int64_t bit =
-                bitmap_find_consec(pool->bitmap, pool->size, curr, n, false);
+    if (prev && next) {
+        vs->ext[i - 1].size += size + vs->ext[i].size;
+        vs_remove(vs, i);
+        return;
+    } else if (prev) {
+        vs->ext[i - 1].size += size;
+        return;
+    } else if (next) {
+        vs->ext[i].base = base;
+        vs->ext[i].size += size;
+        return;
+    }
 
-            if (bit < 0) {
-                /**
-                 * No n page sement was found. If this is the first iteration
-                 * set position to 0 to start next search from index 0.
-                 */
-                curr = aligned ? (n - ((pool->base / PAGE_SIZE) % n)) % n : 0;
-                break;
-            } else if (aligned && (((bit + start) % n) != 0)) {
-                /**
-                 *  If we're looking for an aligned segment and the found
-                 * contigous segment is not aligned, start the search again
-                 * from the last aligned index
-                 */
-                curr = bit + ((bit + start) % n);
-            } else {
-                /**
-                 * We've found our pages. Fill output argument info, mark
-                 * them as allocated, and update page pool bookkeeping.
-                 */
-                ppages->base = pool->base + (bit * PAGE_SIZE);
-                ppages->size = n;
-                bitmap_set_consecutive(pool->bitmap, bit, n);
-                pool->free -= n;
-                pool->last = bit + n;
-                ok = true;
-                break;
+    if (vs->num == VS_MAX_EXTS) {
+        size_t min_i = VS_MAX_EXTS;
+        uint64_t min_size = size;
+        for (size_t j = 0; j < vs->num; j++) {
+            if (vs->ext[j].size < min_size) {
+                min_i = j;
+                min_size = vs->ext[j].size;
             }
         }
+        uint64_t lost = (min_i == VS_MAX_EXTS) ? base : vs->ext[min_i].base;
+        WARNING("vspace full, leaking va range 0x%lx-0x%lx", lost,
+                lost + min_size - 1);
+        if (min_i == VS_MAX_EXTS) return;
+        vs_remove(vs, min_i);
+        if (min_i < i) i--;
     }
-    spin_unlock(&pool->lock);
 
-    return ok;
+    for (size_t j = vs->num; j > i; j--) {
+        vs->ext[j] = vs->ext[j - 1];
+    }
+    vs->ext[i].base = base;
+    vs->ext[i].size = size;
+    vs->num++;
 }
 
-/*
-    分配物理页：遍历page_pool_list，分配大小为n的物理页
-*/
-ppages_t mem_alloc_ppages(uint64_t colors, size_t n, bool aligned)
+static void vs_free(vspace_t *vs, uint64_t base, uint64_t size)
 {
-    ppages_t pages = {.size = 0};
+    vs_insert(vs, vs_find(vs, base), base, size);
+}
 
-    list_foreach(page_pool_list, page_pool_t, pool)
-    {
-        bool ok = (!all_clrs(colors) && !aligned)
-                      ? pp_alloc_clr(pool, n, colors, &pages) // TODO:
-                      : pp_alloc(pool, n, aligned, &pages);
-        if (ok) break;
+static bool vs_reserve(vspace_t *vs, uint64_t base, uint64_t size)
+{
+    size_t i = vs_find(vs, base);
+    if ((i == vs->num) || (vs->ext[i].base > base) ||
+        (vs->ext[i].base + vs->ext[i].size < base + size)) {
+        return false;
     }
 
-    return pages;
+    uint64_t ext_end = vs->ext[i].base + vs->ext[i].size;
+    if (vs->ext[i].base == base) {
+        vs->ext[i].base += size;
+        vs->ext[i].size -= size;
+        if (vs->ext[i].size == 0) vs_remove(vs, i);
+    } else {
+        vs->ext[i].size = base - vs->ext[i].base;
+        if (ext_end > base + size) {
+            vs_insert(vs, i + 1, base + size, ext_end - (base + size));
+        }
+    }
+
+    return true;
 }
 
-/*
-    查虚拟地址位于哪个虚拟地址空间
-*/
-static section_t *mem_find_sec(addr_space_t *as, void *va)
+static uint64_t vs_alloc(vspace_t *vs, uint64_t size)
 {
-    for (int i = 0; i < sections[as->type].sec_size; i++) {
-        if ((va >= sections[as->type].sec[i].beg) &&
-            (va <= sections[as->type].sec[i].end)) {
-            return &sections[as->type].sec[i];
+    for (size_t i = 0; i < vs->num; i++) {
+        if (vs->ext[i].size >= size) {
+            uint64_t base = vs->ext[i].base;
+            vs->ext[i].base += size;
+            vs->ext[i].size -= size;
+            if (vs->ext[i].size == 0) vs_remove(vs, i);
+            return base;
         }
     }
+    return 0;
+}
 
-    return NULL;
+/**
+ * Builds the free ranges of a section from its page tables, the first time
+ * they are needed. Entries neither valid nor reserved are free.
+ */
+static void mem_vspace_init(vspace_t *vs, addr_space_t *as, section_t *sec)
+{
+    uint64_t addr = (uint64_t)sec->beg;
+    uint64_t top = (uint64_t)sec->end;
+    size_t lvl = 0;
+
+    vs->num = 0;
+    vs->ready = true;
+
+    while (addr <= top) {
+        pte_t *pte = pt_get_pte(&as->pt, lvl, (void *)addr);
+        uint64_t lvlsz = pt_lvlsize(&as->pt, lvl);
+        uint64_t span = min((addr & ~(lvlsz - 1)) + lvlsz - addr,
+                            top - addr + 1);
+
+        if (pte_valid(pte) && pte_table(&as->pt, pte, lvl)) {
+            lvl++;
+            continue;
+        }
+
+        if (!pte_valid(pte) && !pte_check_rsw(pte, PTE_RSW_RSRV)) {
+            vs_free(vs, addr, span);
+        }
+
+        addr += span;
+        if (addr == 0) break;
+        lvl = 0;
+    }
 }
 
 static inline bool pte_allocable(addr_space_t *as, pte_t *pte, uint64_t lvl,
@@ -308,6 +1334,50 @@ static inline bool pte_allocable(addr_space_t *as, pte_t *pte, uint64_t lvl,
             ((addr % pt_lvlsize(&as->pt, lvl)) == 0));
 }
 
+/**
+ * Tops up the zeroed page table reserve of a vm address space with a batch
+ * of pages, zeroed through a single temporary hypervisor mapping. Must be
+ * called without holding the address space lock.
+ */
+static void mem_pt_rsv_refill(addr_space_t *as)
+{
+    pt_rsv_t *rsv = &as->pt_rsv;
+
+    if (as->type != AS_VM) return;
+
+    spin_lock(&as->lock);
+    bool refill = !rsv->refilling && (rsv->num < PT_RSV_BATCH);
+    rsv->refilling |= refill;
+    spin_unlock(&as->lock);
+
+    if (!refill) return;
+
+    ppages_t ppages = mem_alloc_ppages(as->colors, PT_RSV_BATCH, false);
+    if (ppages.size == PT_RSV_BATCH) {
+        void *va = mem_alloc_vpage(&cpu.as, SEC_HYP_PRIVATE, NULL,
+                                   PT_RSV_BATCH);
+        mem_map(&cpu.as, va, &ppages, PT_RSV_BATCH, PTE_HYP_FLAGS);
+        memset(va, 0, PT_RSV_BATCH * PAGE_SIZE);
+        fence_sync_write();
+        mem_free_vpage(&cpu.as, va, PT_RSV_BATCH, false);
+    }
+
+    spin_lock(&as->lock);
+    if (ppages.size == PT_RSV_BATCH) {
+        uint64_t index = 0;
+        for (size_t i = 0; i < PT_RSV_BATCH; i++) {
+            if (!all_clrs(ppages.colors)) {
+                index = pp_next_clr(ppages.base, index, ppages.colors);
+            }
+            rsv->pages[rsv->num++] = ppages.base + (index * PAGE_SIZE);
+            index++;
+        }
+        rsv->stats.refills++;
+    }
+    rsv->refilling = false;
+    spin_unlock(&as->lock);
+}
+
 /*
     申请页表页，并关联到上级页表的对应PTE
 */
@@ -316,14 +1386,25 @@ static inline pte_t *mem_alloc_pt(addr_space_t *as, pte_t *parent, uint64_t lvl,
 {
     /* Must have lock on as and va section to call */
     size_t ptsize = pt_size(&as->pt, lvl) / PAGE_SIZE;
+    pt_rsv_t *rsv = &as->pt_rsv;
+    bool zeroed = false;
+    ppages_t ppage;
     // 申请一个物理页来保存页表，也就是页表页
-    ppages_t ppage = mem_alloc_ppages(as->colors, ptsize, ptsize > 1 ? true : false);
+    if ((ptsize == 1) && (rsv->num > 0)) {
+        ppage = mem_ppages_get(rsv->pages[--rsv->num], 1);
+        rsv->stats.hits++;
+        zeroed = true;
+    } else {
+        ppage = mem_alloc_ppages(as->colors, ptsize, ptsize > 1 ? true : false);
+        if (as->type == AS_VM) rsv->stats.misses++;
+    }
     if (ppage.size == 0) return NULL;
+    rsv->stats.pt_pages += ptsize;
     // 设置上级页表中对应的PTE
     pte_set(parent, ppage.base, PTE_TABLE, PTE_HYP_FLAGS);
     fence_sync_write();
     pte_t *temp_pt = pt_get(&as->pt, lvl + 1, (void *)addr);
-    memset(temp_pt, 0, PAGE_SIZE);
+    if (!zeroed) memset(temp_pt, 0, PAGE_SIZE);
     return temp_pt;
 }
 
@@ -337,10 +1418,38 @@ static inline bool pt_pte_mappable(addr_space_t *as, pte_t *pte, uint64_t lvl,
            ((paddr % pt_lvlsize(&as->pt, lvl)) == 0);
 }
 
+/**
+ * Clears the contiguous hint of the run of entries pte belongs to. The hint
+ * can't change on live entries, so the run is invalidated first.
+ */
+static void mem_pt_break_contig(addr_space_t *as, pte_t *pte, uint64_t va,
+                                uint64_t lvl)
+{
+    /* Must have lock on as and va section to call */
+    uint64_t lvlsz = pt_lvlsize(&as->pt, lvl);
+    size_t off = pt_getpteindex(&as->pt, pte, lvl) % PTE_CONTIG_NUM;
+    pte_t *run = pte - off;
+    void *run_va = (void *)(va & ~(PTE_CONTIG_NUM * lvlsz - 1));
+    pte_t vals[PTE_CONTIG_NUM];
+
+    for (size_t i = 0; i < PTE_CONTIG_NUM; i++) {
+        vals[i] = run[i];
+        run[i] = 0;
+    }
+    fence_sync_write();
+    tlb_inv_range(as, run_va, PTE_CONTIG_NUM * lvlsz);
+
+    for (size_t i = 0; i < PTE_CONTIG_NUM; i++) {
+        run[i] = vals[i] & ~PTE_CONTIG;
+    }
+    fence_sync_write();
+}
+
 /*
     分配新的页表页，并插入到va对应PTE
 */
-static void mem_expand_pte(addr_space_t *as, uint64_t va, uint64_t lvl)
+static void mem_expand_pte(addr_space_t *as, pte_t *pte, uint64_t va,
+                           uint64_t lvl)
 {
     /* Must have lock on as and va section to call */
 
@@ -349,14 +1458,14 @@ static void mem_expand_pte(addr_space_t *as, uint64_t va, uint64_t lvl)
         return;
     }
 
-    // 由va计算待插入的PTE
-    pte_t *pte = pt_get_pte(&as->pt, lvl, (void *)va);
-
     /**
      * only can expand if the pte exists and it isnt pointing to
      * a next level table already.
      */
     if (pte != NULL && !pte_table(&as->pt, pte, lvl)) {
+        if (pte_valid(pte) && (*pte & PTE_CONTIG)) {
+            mem_pt_break_contig(as, pte, va, lvl);
+        }
         pte_t pte_val = *pte;  // save the original pte, TODO: why need this ?????
         bool rsv = pte_check_rsw(pte, PTE_RSW_RSRV);
         bool vld = pte_valid(pte);
@@ -377,7 +1486,7 @@ static void mem_expand_pte(addr_space_t *as, uint64_t va, uint64_t lvl)
              * Therefore this function cannot be call on the entry mapping
              * hypervisor code or data used in it (including stack).
              */
-            tlb_inv_va(&cpu.as, (void *)va);
+            tlb_inv_va(as, (void *)va);
 
             /**
              *  Now traverse the new next level page table to replicate the
@@ -421,12 +1530,11 @@ static void mem_inflate_pt(addr_space_t *as, uint64_t va, uint64_t length)
      * as a next level page table.
      */
     for (int lvl = 0; lvl < as->pt.dscr->lvls - 1; lvl++) {
-        uint64_t vaddr = va;
-        // 计算当前等级页表中，每个表项代表多大的空间；e.g, every entry size in level 3 is 4kb
-        uint64_t lvlsz = pt_lvlsize(&as->pt, lvl); 
-        while (vaddr < (va + length)) {
-            mem_expand_pte(as, vaddr, lvl); // 插入table descriptor
-            vaddr += lvlsz;
+        pt_cursor_t cur;
+        pt_cursor_init(&cur, &as->pt, lvl, (void *)va);
+        while ((uint64_t)cur.va < (va + length)) {
+            mem_expand_pte(as, cur.pte, (uint64_t)cur.va, lvl); // 插入table descriptor
+            pt_cursor_next(&cur);
         }
     }
 }
@@ -461,7 +1569,18 @@ void *mem_alloc_vpage(addr_space_t *as, enum AS_SEC section, void *at, size_t n)
     spin_lock(&as->lock);
     if (sec->shared) spin_lock(&sec->lock);
 
-    while (count < n && !failed) {
+    vspace_t *vs = mem_vspace(as, sec);
+    if (vs != NULL) {
+        if (!vs->ready) mem_vspace_init(vs, as, sec);
+        if (at != NULL) {
+            vpage = vs_reserve(vs, (uint64_t)addr, n * PAGE_SIZE) ? addr : NULL;
+        } else {
+            vpage = (void *)vs_alloc(vs, n * PAGE_SIZE);
+        }
+        failed = (vpage == NULL);
+    }
+
+    while (vs == NULL && count < n && !failed) {
         // check if there is still enough space in as
         if (((uint64_t)top + 1 - (uint64_t)addr) / PAGE_SIZE < n) {
             vpage = NULL;
@@ -508,19 +1627,38 @@ void *mem_alloc_vpage(addr_space_t *as, enum AS_SEC section, void *at, size_t n)
         }
     }
 
-    // mark page trable entries as reserved
-    if (vpage != NULL && !failed) {
+    /**
+     * Mark page table entries as reserved. Sections with a vspace track
+     * their free addresses there, so their tables are left untouched. A
+     * reservation would cover whole entries of the level found invalid, which
+     * may span past the n pages handed out and keep the tables from being
+     * reclaimed.
+     */
+    if (vs == NULL && vpage != NULL && !failed) {
+        pt_cursor_t cur;
+        bool found = false;
         count = 0;
         addr = vpage;
         int lvl = 0;
         while (count < n) {
-            for (lvl = 0; lvl < as->pt.dscr->lvls; lvl++) {
-                pte = pt_get_pte(&as->pt, lvl, addr);
-                if (!pte_valid(pte)) break;
+            /**
+             * The next entry of the same table shares the parent tables, so
+             * only look up the first invalid level again when it is valid or
+             * in a different table.
+             */
+            if (!found) {
+                lvl = 0;
+                pte = pt_cursor_init(&cur, &as->pt, lvl, addr);
+                while (pte_valid(pte) && (lvl + 1) < as->pt.dscr->lvls) {
+                    pte = pt_cursor_init(&cur, &as->pt, ++lvl, addr);
+                }
             }
             pte_set_rsw(pte, PTE_RSW_RSRV);
             addr += pt_lvlsize(&as->pt, lvl);
             count += pt_lvlsize(&as->pt, lvl) / PAGE_SIZE;
+            pte = pt_cursor_next(&cur);
+            found = (pt_getpteindex_by_va(&as->pt, addr, lvl) != 0) &&
+                    !pte_valid(pte);
         }
     }
 
@@ -528,29 +1666,168 @@ void *mem_alloc_vpage(addr_space_t *as, enum AS_SEC section, void *at, size_t n)
 
     spin_unlock(&as->lock);
 
+    mem_pt_rsv_refill(as);
+
     return vpage;
 }
 
-void mem_free_vpage(addr_space_t *as, void *at, size_t n, bool free_ppages)
+/**
+ * Unmapped physical pages can only be given back once the TLB entries that
+ * might still reference them are invalidated. Unmaps are gathered in a batch
+ * spanning a contiguous virtual range, which is invalidated at once before
+ * freeing the batch's pages.
+ */
+#define MEM_UNMAP_BATCH (16)
+
+/**
+ * Returns the pte of va at level lvl, or NULL if any of the upper levels
+ * does not point to a table.
+ */
+static pte_t *mem_pt_walk(addr_space_t *as, size_t lvl, void *va)
+{
+    for (size_t l = 0; l < lvl; l++) {
+        pte_t *pte = pt_get_pte(&as->pt, l, va);
+        if (pte == NULL || !pte_valid(pte) || !pte_table(&as->pt, pte, l)) {
+            return NULL;
+        }
+    }
+    return pt_get_pte(&as->pt, lvl, va);
+}
+
+/**
+ * Frees the page tables covering [at, top) left without any valid or
+ * reserved entry, deepest level first so emptied parents are freed too.
+ * Tables hanging from the root of a shared hypervisor section are kept, as
+ * other cpus' roots point to them as well.
+ */
+static void mem_pt_reclaim(addr_space_t *as, section_t *sec, void *at,
+                           void *top)
+{
+    /* Must have lock on as and va section to call */
+    size_t min_lvl = (as->type != AS_VM && sec->shared) ? 2 : 1;
+
+    for (size_t lvl = as->pt.dscr->lvls - 1; lvl >= min_lvl; lvl--) {
+        uint64_t span = pt_lvlsize(&as->pt, lvl - 1);
+        uint64_t va = ((uint64_t)at) & ~(span - 1);
+
+        for (; va < (uint64_t)top; va += span) {
+            pte_t *parent = mem_pt_walk(as, lvl - 1, (void *)va);
+            if (parent == NULL || !pte_valid(parent) ||
+                !pte_table(&as->pt, parent, lvl - 1)) {
+                continue;
+            }
+
+            pte_t *pt = pt_get(&as->pt, lvl, (void *)va);
+            bool empty = true;
+            for (size_t i = 0; empty && i < pt_nentries(&as->pt, lvl); i++) {
+                empty = (pt[i] == 0);
+            }
+            if (!empty) continue;
+
+            ppages_t ppages = mem_ppages_get(
+                pte_addr(parent), NUM_PAGES(pt_size(&as->pt, lvl)));
+            *parent = 0;
+            fence_sync_write();
+
+            /**
+             * Drop the walk cache entries through the table, and the
+             * hypervisor's own mapping of the table, before reusing it.
+             */
+            tlb_inv_range(as, (void *)va, span);
+            tlb_hyp_inv_va(pt);
+
+            mem_free_ppages(&ppages);
+            /* boot tables of the hypervisor were not counted */
+            as->pt_rsv.stats.pt_pages -=
+                min(as->pt_rsv.stats.pt_pages, ppages.size);
+            as->pt_rsv.stats.reclaimed += ppages.size;
+        }
+    }
+}
+
+typedef struct {
+    addr_space_t *as;
+    void *start;
+    void *end;
+    size_t num;
+    ppages_t ppages[MEM_UNMAP_BATCH];
+} mem_unmap_batch_t;
+
+static void mem_unmap_flush(mem_unmap_batch_t *batch)
+{
+    if (batch->end > batch->start) {
+        tlb_inv_range(batch->as, batch->start, batch->end - batch->start);
+    }
+
+    for (size_t i = 0; i < batch->num; i++) {
+        mem_free_ppages(&batch->ppages[i]);
+    }
+
+    batch->start = batch->end = NULL;
+    batch->num = 0;
+}
+
+static void mem_unmap_add(mem_unmap_batch_t *batch, void *va, size_t size,
+                          ppages_t *ppages)
+{
+    bool empty = (batch->end == batch->start);
+    ppages_t *last = (batch->num > 0) ? &batch->ppages[batch->num - 1] : NULL;
+
+    if (!empty && (batch->end != va)) {
+        mem_unmap_flush(batch);
+        empty = true;
+        last = NULL;
+    }
+
+    if (empty) batch->start = va;
+    batch->end = va + size;
+
+    if (ppages == NULL) return;
+
+    if ((last != NULL) && (last->colors == ppages->colors) &&
+        (last->base + (last->size * PAGE_SIZE) == ppages->base)) {
+        last->size += ppages->size;
+    } else {
+        if (batch->num == MEM_UNMAP_BATCH) {
+            mem_unmap_flush(batch);
+            batch->start = va;
+            batch->end = va + size;
+        }
+        batch->ppages[batch->num++] = *ppages;
+    }
+}
+
+void mem_unmap(addr_space_t *as, void *at, size_t n, bool free_ppages)
 {
     void *vaddr = at;
     void *top = at + (n * PAGE_SIZE);
     int lvl = 0;
+    mem_unmap_batch_t batch = {.as = as};
 
     spin_lock(&as->lock);
 
     section_t *sec = mem_find_sec(as, at);
     if (sec->shared) spin_lock(&sec->lock);
 
+    pt_cursor_t cur;
+    pt_cursor_init(&cur, &as->pt, lvl, vaddr);
+
     while (vaddr < top) {
-        pte_t *pte = pt_get_pte(&as->pt, lvl, vaddr);
+        pte_t *pte = cur.pte;
         if (pte == NULL) {
             ERROR("invalid pte while freeing vpages");
         } else if (!pte_valid(pte)) {
             uint64_t lvlsz = pt_lvlsize(&as->pt, lvl);
-            vaddr += lvlsz;
+            void *vpage_base = (void *)(((uint64_t)vaddr) & ~(lvlsz - 1));
+            /* drop the reservation of entries wholly in the range */
+            if (vaddr == vpage_base && (vpage_base + lvlsz) <= top) {
+                *pte = 0;
+            }
+            vaddr = vpage_base + lvlsz;
+            pt_cursor_next(&cur);
         } else if (pte_table(&as->pt, pte, lvl)) {
             lvl++;
+            pt_cursor_init(&cur, &as->pt, lvl, vaddr);
         } else {
             uint64_t entry = pt_getpteindex(&as->pt, pte, lvl);
             uint64_t nentries = pt_nentries(&as->pt, lvl);
@@ -562,20 +1839,24 @@ void mem_free_vpage(addr_space_t *as, void *at, size_t n, bool free_ppages)
                         (void *)(((uint64_t)vaddr) & ~(lvlsz - 1));
 
                     if (vaddr > vpage_base || top < (vpage_base + lvlsz)) {
-                        mem_expand_pte(as, (uint64_t)vaddr, lvl);
+                        mem_expand_pte(as, pte, (uint64_t)vaddr, lvl);
                         lvl++;
                         break;
                     }
 
-                    if (free_ppages) {
-                        uint64_t paddr = pte_addr(pte);
-                        ppages_t ppages =
-                            mem_ppages_get(paddr, lvlsz / PAGE_SIZE);
-                        mem_free_ppages(&ppages);
+                    /* unmapping only part of a contiguous run */
+                    uint64_t run_sz = PTE_CONTIG_NUM * lvlsz;
+                    void *run_base = (void *)(((uint64_t)vaddr) & ~(run_sz - 1));
+                    if ((*pte & PTE_CONTIG) &&
+                        (run_base < at || top < (run_base + run_sz))) {
+                        mem_pt_break_contig(as, pte, (uint64_t)vaddr, lvl);
                     }
 
+                    ppages_t ppages =
+                        mem_ppages_get(pte_addr(pte), lvlsz / PAGE_SIZE);
                     *pte = 0;
-                    tlb_inv_va(&cpu.as, (void *)vaddr);
+                    mem_unmap_add(&batch, vaddr, lvlsz,
+                                  free_ppages ? &ppages : NULL);
 
                 } else {
                     break;
@@ -588,19 +1869,36 @@ void mem_free_vpage(addr_space_t *as, void *at, size_t n, bool free_ppages)
             if (entry == nentries) {
                 lvl--;
             }
-
-            /**
-             * TODO: check if the current pt is now empty and if so,
-             * free it too up to the root.
-             */
+            pt_cursor_init(&cur, &as->pt, lvl, vaddr);
         }
     }
 
+    mem_unmap_flush(&batch);
+
+    /**
+     * The hypervisor's private section mostly holds short-lived windows,
+     * e.g., to zero or copy a few pages, whose tables would be allocated
+     * again right away. Keep them.
+     */
+    if (as->type == AS_VM || sec != &hyp_secs[SEC_HYP_PRIVATE]) {
+        mem_pt_reclaim(as, sec, at, top);
+    }
+
+    vspace_t *vs = mem_vspace(as, sec);
+    if (vs != NULL && vs->ready) {
+        vs_free(vs, (uint64_t)at, n * PAGE_SIZE);
+    }
+
     if (sec->shared) spin_unlock(&sec->lock);
 
     spin_unlock(&as->lock);
 }
 
+void mem_free_vpage(addr_space_t *as, void *at, size_t n, bool free_ppages)
+{
+    mem_unmap(as, at, n, free_ppages);
+}
+
 /*
      N virtual pages ==> N physical pages
 */
@@ -634,17 +1932,17 @@ int mem_map(addr_space_t *as, void *va, ppages_t *ppages, size_t n,
     // 物理页需要染色的分支
     if (ppages && !all_clrs(ppages->colors)) {
         uint64_t index = 0;
+        pt_cursor_t cur;
         // 在多级页表中,为大小为n的虚拟页申请PTE
         mem_inflate_pt(as, (uint64_t)vaddr, n * PAGE_SIZE);
         // 对每个虚拟页，设置末级页表对应PTE中的物理地址字段
+        pte = pt_cursor_init(&cur, &as->pt, as->pt.dscr->lvls - 1, vaddr);
         for (int i = 0; i < ppages->size; i++) {
-            // 找到末级页表中，虚拟页对应的PTE
-            pte = pt_get_pte(&as->pt, as->pt.dscr->lvls - 1, vaddr);
             // TODO:
             index = pp_next_clr(ppages->base, index, ppages->colors);
             uint64_t paddr = ppages->base + (index * PAGE_SIZE);
             pte_set(pte, paddr, PTE_PAGE, flags);
-            vaddr += PAGE_SIZE;
+            pte = pt_cursor_next(&cur);
             index++;
         }
     } else { // 不需要染色的分支
@@ -670,11 +1968,33 @@ int mem_map(addr_space_t *as, void *va, ppages_t *ppages, size_t n,
             uint64_t nentries = pt_nentries(&as->pt, lvl); // 页表包含多少个PTE
             uint64_t lvlsz = pt_lvlsize(&as->pt, lvl); // 每个PTE表示的物理块大小
 
+            /**
+             * Entries left of the current run mapped with the contiguous
+             * hint. Only vm stage-2 runs get the hint, when the run is
+             * aligned and fully mapped here to contiguous physical memory.
+             */
+            size_t contig = 0;
+            size_t run_pages = PTE_CONTIG_NUM * lvlsz / PAGE_SIZE;
+
             // PTE没有超出当前页表 && 已映射的物理页数量 && 未映射物理页数量至少大于一个PTE表示物理块
             while ((entry < nentries) && (count < n) &&
                    (n - count >= lvlsz / PAGE_SIZE)) {
+                if ((PTE_CONTIG_NUM > 1) && (as->type == AS_VM) &&
+                    (contig == 0) && (entry % PTE_CONTIG_NUM == 0) &&
+                    (n - count >= run_pages)) {
+                    if (ppages == NULL) {
+                        ppages_t temp =
+                            mem_alloc_ppages(as->colors, run_pages, true);
+                        if (temp.size == run_pages) {
+                            paddr = temp.base;
+                            contig = PTE_CONTIG_NUM;
+                        }
+                    } else if ((paddr % (run_pages * PAGE_SIZE)) == 0) {
+                        contig = PTE_CONTIG_NUM;
+                    }
+                }
                 // 为什么ppages还能未空???
-                if (ppages == NULL) {
+                if (ppages == NULL && contig == 0) {
                     ppages_t temp =
                         mem_alloc_ppages(as->colors, lvlsz / PAGE_SIZE, true); // 为什么不是分配n页???
                     if (temp.size < lvlsz / PAGE_SIZE) {
@@ -692,7 +2012,9 @@ int mem_map(addr_space_t *as, void *va, ppages_t *ppages, size_t n,
                     paddr = temp.base;
                 }
                 // 实现映射，大小是当前PTE表示的物理块大小
-                pte_set(pte, paddr, pt_pte_type(&as->pt, lvl), flags);
+                pte_set(pte, paddr, pt_pte_type(&as->pt, lvl),
+                        contig > 0 ? (flags | PTE_CONTIG) : flags);
+                if (contig > 0) contig--;
                 vaddr += lvlsz; // 下个虚拟页地址
                 paddr += lvlsz; // 下个物理页地址
                 count += lvlsz / PAGE_SIZE; // 累加已映射的页数
@@ -710,30 +2032,44 @@ int mem_map(addr_space_t *as, void *va, ppages_t *ppages, size_t n,
     }
     spin_unlock(&as->lock);
 
+    mem_pt_rsv_refill(as);
+
     return 0;
 }
 
-int mem_map_reclr(addr_space_t *as, void *va, ppages_t *ppages, size_t n,
-                  uint64_t flags)
+/**
+ * Counts how many of the first n pages of an image, whose first page has
+ * color offset clr_offset, fall outside the given colors.
+ */
+static size_t mem_reclr_count(uint64_t colors, uint64_t clr_offset, size_t n)
+{
+    size_t period = COLOR_NUM * COLOR_SIZE;
+    size_t count = n / period * COLOR_SIZE *
+                   bitmap_count((bitmap_t)&colors, 0, COLOR_NUM, false);
+    for (int i = 0; i < (n % period); i++) {
+        if (!bitmap_get((bitmap_t)&colors,
+                        (i + clr_offset) / COLOR_SIZE % COLOR_NUM))
+            count++;
+    }
+    return count;
+}
+
+int mem_map_reclr_start(mem_reclr_t *reclr, addr_space_t *as, void *va,
+                        ppages_t *ppages, size_t n, uint64_t flags)
 {
     if (ppages == NULL) {
         ERROR("no indication on what to recolor");
     }
 
+    memset(reclr, 0, sizeof(*reclr));
+
     /**
      * Count how many pages are not colored in original images.
      * Allocate the necessary colored pages.
      * Mapped onto hypervisor address space.
      */
-    uint64_t reclrd_num =
-        n / (COLOR_NUM * COLOR_SIZE) * COLOR_SIZE *
-        bitmap_count((bitmap_t)&as->colors, 0, COLOR_NUM, false);
     uint64_t clr_offset = (ppages->base / PAGE_SIZE) % (COLOR_NUM * COLOR_SIZE);
-    for (int i = 0; i < (n % (COLOR_NUM * COLOR_SIZE)); i++) {
-        if (!bitmap_get((bitmap_t)&as->colors,
-                        (i + clr_offset) / COLOR_SIZE % COLOR_NUM))
-            reclrd_num++;
-    }
+    uint64_t reclrd_num = mem_reclr_count(as->colors, clr_offset, n);
 
    /**
      * If the address space was not assigned any specific color,
@@ -757,8 +2093,6 @@ int mem_map_reclr(addr_space_t *as, void *va, ppages_t *ppages, size_t n,
     pte_t *pte = NULL;
     void *vaddr = (void *)(((uint64_t)va) & ~(PAGE_SIZE - 1));
     uint64_t paddr = ppages->base;
-    void *clrd_vaddr = reclrd_va_base;
-    void *phys_va = phys_va_base;
     uint64_t index = 0;
 
     /**
@@ -767,51 +2101,110 @@ int mem_map_reclr(addr_space_t *as, void *va, ppages_t *ppages, size_t n,
      */
     mem_inflate_pt(as, (uint64_t)vaddr, n * PAGE_SIZE);
 
+    pt_cursor_t cur;
+    pt_cursor_init(&cur, &as->pt, as->pt.dscr->lvls - 1, vaddr);
     for (int i = 0; i < n; i++) {
-        pte = pt_get_pte(&as->pt, as->pt.dscr->lvls - 1, vaddr);
+        pte = cur.pte;
 
         /**
-         * If image page is already color, just map it.
-         * Otherwise first copy it to the previously allocated pages.
+         * If image page is already color, just map it. Otherwise map
+         * the colored page its contents will be copied to.
          */
         if (bitmap_get((bitmap_t)&as->colors,
                        ((i + clr_offset) / COLOR_SIZE % COLOR_NUM))) {
             pte_set(pte, paddr, PTE_PAGE, flags);
 
         } else {
-            memcpy(clrd_vaddr, phys_va, PAGE_SIZE);
             index = pp_next_clr(reclrd_ppages.base, index, as->colors);
             uint64_t clrd_paddr = reclrd_ppages.base + (index * PAGE_SIZE);
             pte_set(pte, clrd_paddr, PTE_PAGE, flags);
 
-            clrd_vaddr += PAGE_SIZE;
             index++;
         }
         paddr += PAGE_SIZE;
-        phys_va += PAGE_SIZE;
-        vaddr += PAGE_SIZE;
+        pt_cursor_next(&cur);
+    }
+
+    reclr->ppages = mem_ppages_get(ppages->base, n);
+    reclr->colors = as->colors;
+    reclr->clr_offset = clr_offset;
+    reclr->phys_va = phys_va_base;
+    reclr->reclrd_va = reclrd_va_base;
+    reclr->reclrd_num = reclrd_num;
+
+    return 0;
+}
+
+/**
+ * Copies the uncolored pages found in part number part, out of parts equal
+ * shares of the image, to their colored pages and flushes them.
+ */
+void mem_map_reclr_copy(mem_reclr_t *reclr, size_t part, size_t parts)
+{
+    if (reclr->reclrd_num == 0) return;
+
+    size_t n = reclr->ppages.size;
+    size_t i = n * part / parts;
+    size_t end = n * (part + 1) / parts;
+    size_t first = mem_reclr_count(reclr->colors, reclr->clr_offset, i);
+    size_t k = first;
+
+    /**
+     * Copy whole runs of same color pages at a time. The k-th uncolored
+     * page of the image goes to the k-th page of the colored mapping.
+     */
+    while (i < end) {
+        size_t clr_pos = (i + reclr->clr_offset) % COLOR_SIZE;
+        size_t len = min(COLOR_SIZE - clr_pos, end - i);
+        if (!bitmap_get((bitmap_t)&reclr->colors,
+                        (i + reclr->clr_offset) / COLOR_SIZE % COLOR_NUM)) {
+            memcpy(reclr->reclrd_va + k * PAGE_SIZE,
+                   reclr->phys_va + i * PAGE_SIZE, len * PAGE_SIZE);
+            k += len;
+        }
+        i += len;
     }
 
     /**
      * Flush the newly allocated colored pages to which parts of the
      * image was copied, and might stayed in the cache system.
      */
-    cache_flush_range(reclrd_va_base, reclrd_num * PAGE_SIZE);
+    if (k > first) {
+        cache_flush_range(reclr->reclrd_va + first * PAGE_SIZE,
+                          (k - first) * PAGE_SIZE);
+    }
+}
+
+void mem_map_reclr_finish(mem_reclr_t *reclr)
+{
+    if (reclr->reclrd_num == 0) return;
 
     /**
      * Free the uncolored pages of the original image.
      */
     ppages_t unused_pages = {
-        .base = ppages->base,
-        .size = reclrd_num,
-        .colors = ~as->colors
+        .base = reclr->ppages.base,
+        .size = reclr->reclrd_num,
+        .colors = ~reclr->colors
     };
     mem_free_ppages(&unused_pages);
 
-    mem_free_vpage(&cpu.as, reclrd_va_base, reclrd_num, false);
-    mem_free_vpage(&cpu.as, phys_va_base, n, false);
+    mem_free_vpage(&cpu.as, reclr->reclrd_va, reclr->reclrd_num, false);
+    mem_free_vpage(&cpu.as, reclr->phys_va, reclr->ppages.size, false);
 
-    return 0;
+    reclr->reclrd_num = 0;
+}
+
+int mem_map_reclr(addr_space_t *as, void *va, ppages_t *ppages, size_t n,
+                  uint64_t flags)
+{
+    mem_reclr_t reclr;
+    int res = mem_map_reclr_start(&reclr, as, va, ppages, n, flags);
+    if (res == 0) {
+        mem_map_reclr_copy(&reclr, 0, 1);
+        mem_map_reclr_finish(&reclr);
+    }
+    return res;
 }
 
 bool mem_are_ppages_reserved_in_pool(page_pool_t *ppool, ppages_t *ppages)
@@ -867,8 +2260,19 @@ bool mem_reserve_ppool_ppages(page_pool_t *pool, ppages_t *ppages)
         was_free = false;
     }
 
+    /* Only account for the pages that were not already reserved */
+    for (size_t i = pageoff; i < pageoff + numpages;) {
+        size_t count = bitmap_count_consecutive(
+            pool->bitmap, pageoff + numpages, i, pageoff + numpages - i);
+        if (!bitmap_get(pool->bitmap, i)) {
+            pp_clr_account(pool, i, count, false);
+            pool->free -= count;
+        }
+        i += count;
+    }
+
     bitmap_set_consecutive(pool->bitmap, pageoff, numpages);
-    pool->free -= numpages;
+    pp_blk_take_range(pool, pageoff, numpages);
 
     return is_in_rgn && was_free;
 }
@@ -945,8 +2349,7 @@ bool root_pool_set_up_bitmap(uint64_t load_addr)
     size_t cpu_size = platform.cpu_num * cpu_boot_alloc_size();
     
     // 计算存储bitmap需要多少个物理页, root_pool.size的单位是page
-    uint64_t bitmap_size = root_pool.size / (8 * PAGE_SIZE) +
-                           ((root_pool.size % (8 * PAGE_SIZE) != 0) ? 1 : 0);
+    uint64_t bitmap_size = pp_metadata_size(root_pool.size);
     if (root_pool.size <= bitmap_size) return false;
     
     // root_pool.bitmap的物理地址，位于image,config,cpu privite的后面
@@ -960,10 +2363,9 @@ bool root_pool_set_up_bitmap(uint64_t load_addr)
         mem_alloc_vpage(&cpu.as, SEC_HYP_GLOBAL, NULL, bitmap_size);
     if (root_bitmap == NULL) return false;
 
-    root_pool.bitmap = root_bitmap;
     // 虚拟页映射到物理页
-    mem_map(&cpu.as, root_pool.bitmap, &bitmap_pp, bitmap_size, PTE_HYP_FLAGS);
-    memset(root_pool.bitmap, 0, bitmap_size * PAGE_SIZE);
+    mem_map(&cpu.as, root_bitmap, &bitmap_pp, bitmap_size, PTE_HYP_FLAGS);
+    pp_metadata_init(&root_pool, root_bitmap);
 
     return mem_reserve_ppool_ppages(&root_pool, &bitmap_pp);
 }
@@ -1017,23 +2419,25 @@ static void pp_init(page_pool_t *pool, uint64_t base, size_t size)
     if (pool == NULL) return;
 
     memset(pool, 0, sizeof(page_pool_t));
+    for (size_t i = 0; i <= PP_MAX_ORDER; i++) {
+        pool->free_blks[i] = PP_LINK_NONE;
+    }
     pool->base = ALIGN(base, PAGE_SIZE);
     pool->size = NUM_PAGES(size);
-    // 1 bit表示1 page，bitmap_size是所需的字节数
-    uint64_t bitmap_size =
-        pool->size / (8 * PAGE_SIZE) + !!(pool->size % (8 * PAGE_SIZE) != 0); // FIXME: why !!
+    // bitmap及伙伴系统元数据所需的页数
+    uint64_t bitmap_size = pp_metadata_size(pool->size);
 
     if (size <= bitmap_size) return; // 可能发生嘛？
 
     pages = mem_alloc_ppages(cpu.as.colors, bitmap_size, false);
     if (pages.size != bitmap_size) return;
 
-    if ((pool->bitmap = mem_alloc_vpage(&cpu.as, SEC_HYP_GLOBAL, NULL,
-                                        bitmap_size)) == NULL)
-        return;
+    void *metadata = mem_alloc_vpage(&cpu.as, SEC_HYP_GLOBAL, NULL,
+                                     bitmap_size);
+    if (metadata == NULL) return;
 
-    mem_map(&cpu.as, pool->bitmap, &pages, bitmap_size, PTE_HYP_FLAGS);
-    memset(pool->bitmap, 0, bitmap_size * PAGE_SIZE);
+    mem_map(&cpu.as, metadata, &pages, bitmap_size, PTE_HYP_FLAGS);
+    pp_metadata_init(pool, metadata);
 
     pool->last = 0;
     pool->free = pool->size - bitmap_size;
@@ -1107,7 +2511,8 @@ bool mem_reserve_physical_memory(uint64_t config_addr, page_pool_t *pool)
 bool mem_create_ppools(uint64_t config_addr, struct mem_region *root_mem_region)
 {
     /* Add remaining memory regions to a temporary page pool list */
-    objcache_init(&pagepool_cache, sizeof(page_pool_t), SEC_HYP_GLOBAL, true);
+    objcache_init(&pagepool_cache, sizeof(page_pool_t), SEC_HYP_GLOBAL,
+                  OBJCACHE_PRIME);
     for (size_t i = 0; i < platform.region_num; i++) {
         if (&platform.regions[i] != root_mem_region) {
             struct mem_region *reg = &platform.regions[i];
@@ -1232,9 +2637,7 @@ void color_hypervisor(const uint64_t load_addr, const uint64_t config_addr)
     size_t image_size = (size_t)(&_image_end - &_image_start);
     size_t cpu_boot_size = cpu_boot_alloc_size();
     size_t config_size = (size_t)(&_config_end - &_config_start);
-    size_t bitmap_size = (root_pool.size / (8 * PAGE_SIZE) +
-                          !!(root_pool.size % (8 * PAGE_SIZE) != 0)) *
-                         PAGE_SIZE;
+    size_t bitmap_size = pp_metadata_size(root_pool.size) * PAGE_SIZE;
     uint64_t colors = vm_config_ptr->hyp_colors;
 
     /* Set hypervisor colors in current address space */
@@ -1411,6 +2814,8 @@ void as_init(addr_space_t *as, enum AS_TYPE type, uint64_t id, void *root_pt,
     as->colors = colors;
     as->lock = SPINLOCK_INITVAL;
     as->id = id;
+    as->vs_enabled = false;
+    memset(&as->pt_rsv, 0, sizeof(as->pt_rsv));
 
     if (root_pt == NULL) {
         size_t n = pt_size(&as->pt, 0) / PAGE_SIZE;
@@ -1418,11 +2823,14 @@ void as_init(addr_space_t *as, enum AS_TYPE type, uint64_t id, void *root_pt,
             type == AS_HYP || type == AS_HYP_CPY ? SEC_HYP_PRIVATE : SEC_HYP_VM, 
             true);
         memset(root_pt, 0, n * PAGE_SIZE);
+        as->pt_rsv.stats.pt_pages = n;
     }
     as->pt.root_flags = 0;
     as->pt.root = (pte_t *)root_pt;
 
     as_arch_init(as);
+
+    mem_pt_rsv_refill(as);
 }
 
 void mem_init(uint64_t load_addr, uint64_t config_addr)
@@ -1465,8 +2873,18 @@ void mem_init(uint64_t load_addr, uint64_t config_addr)
 
         if (!config_found)
             ERROR("config was not loaded in a defined platform region");
+
+        objcache_std_init();
     }
 
     /* Wait for master core to initialize memory management */
     cpu_sync_barrier(&cpu_glb_sync);
+
+    /**
+     * Only start caching pages once the hypervisor runs on its final address
+     * space, as coloring it copies the cpu private region.
+     */
+    cpu.page_mag.colors = pp_mag_key(cpu.as.colors);
+    cpu.page_mag.enabled = true;
+    cpu.as.vs_enabled = true;
 }
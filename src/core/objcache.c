@@ -14,6 +14,7 @@
  */
 
 #include <objcache.h>
+#include <cpu.h>
 #include <string.h>
 
 typedef union slab {
@@ -33,10 +34,19 @@ typedef union slab {
 
 } slab_t;
 
-// TODO
-// static size_t std_objcache_sizes[] = {32, 64, 128, 256, 512, 1024};
-// static objcache_t
-// std_objcache_list[sizeof(std_objcache_sizes)/sizeof(size_t)];
+/**
+ * General purpose caches, one per size class. The last class is the largest
+ * size that still fits two objects, with their list nodes, in a slab after
+ * its header. Bigger allocations take whole pages.
+ */
+#define SLAB_HEADER_SIZE (sizeof(((slab_t*)NULL)->header))
+#define OBJCACHE_STD_MAX \
+    (((SLAB_SIZE - SLAB_HEADER_SIZE) / 2 - sizeof(node_t)) & ~0x7UL)
+
+static size_t std_objcache_sizes[] = {32,  64,   128,
+                                      256, 512, 1024, OBJCACHE_STD_MAX};
+static objcache_t
+    std_objcache_list[sizeof(std_objcache_sizes) / sizeof(size_t)];
 
 static slab_t* slab_create(objcache_t* oc, enum AS_SEC sec)
 {
@@ -79,21 +89,32 @@ static void* slab_alloc(slab_t* slab)
     return obj;
 }
 
+static bool slab_obj_valid(slab_t* slab, void* obj)
+{
+    void* obj_addr = obj - sizeof(node_t);
+
+    return (slab != NULL) &&
+           ((((uint64_t)slab) & ~(PAGE_SIZE - 1)) ==
+            (((uint64_t)obj_addr) &
+             ~(PAGE_SIZE - 1))) &&  // obj is part of slab
+           ((((uint64_t)obj_addr) & (PAGE_SIZE - 1)) >=
+            sizeof(slab->header)) &&
+           ((((((uint64_t)obj_addr) & (PAGE_SIZE - 1)) -
+              sizeof(slab->header)) %
+             slab->header.objsize) == 0) &&  // is aligned to object in slab
+           (*((node_t*)obj_addr) ==
+            NULL);  // the node is not currently in any slab
+}
+
 static bool slab_free(slab_t* slab, void* obj)
 {
     void* obj_addr = obj - sizeof(node_t);
 
     if (slab != NULL) {
-        if (((((uint64_t)slab) & ~(PAGE_SIZE - 1)) ==
-             (((uint64_t)obj_addr) &
-              ~(PAGE_SIZE - 1))) &&  // obj is part of slab
-            ((((((uint64_t)obj_addr) & (PAGE_SIZE - 1)) -
-               sizeof(slab->header)) %
-              slab->header.objsize) == 0) &&  // is aligned to object in slab
-            (*((node_t*)(obj - sizeof(node_t))) ==
-             NULL)) {  // the node is not currently in any slab
-
-            memset(obj_addr, 0, slab->header.objsize);
+        if (slab_obj_valid(slab, obj)) {
+            if (!(slab->header.cache->flags & OBJCACHE_NOZERO)) {
+                memset(obj_addr, 0, slab->header.objsize);
+            }
             list_push(&slab->header.free, obj_addr);
             slab->header.objcount++;
             return true;
@@ -117,50 +138,141 @@ static bool slab_empty(slab_t* slab)
     return slab->header.objnum == slab->header.objcount;
 }
 
-void objcache_init(objcache_t* oc, size_t osize, enum AS_SEC sec, bool prime)
+void objcache_init(objcache_t* oc, size_t osize, enum AS_SEC sec,
+                   uint64_t flags)
 {
     oc->osize = osize;
     list_init(&oc->slabs);
     oc->last_free = NULL;
     oc->lock = SPINLOCK_INITVAL;
     oc->section = sec;
+    oc->flags = flags;
+    oc->empty = 0;
 
-    if (prime) {
+    if (flags & OBJCACHE_PRIME) {
         slab_t* slab = slab_create(oc, sec);
         list_push(&oc->slabs, &slab->header.next);
         oc->last_free = slab;
+        oc->empty = 1;
     }
 }
 
-void* objcache_alloc(objcache_t* oc)
+/**
+ * Allocate an object from the slabs, creating a new slab if all are full.
+ * Must be called with the cache lock held.
+ */
+static void* objcache_slab_alloc(objcache_t* oc)
 {
-    void* object = NULL;
-    slab_t* slab = NULL;
+    slab_t* slab = oc->last_free;
 
-    if (oc != NULL) {
-        spin_lock(&oc->lock);
-
-        if (oc->last_free == NULL) {
-            list_foreach(oc->slabs, slab_t, islab)
-            {
-                if (!slab_full(islab)) {
-                    slab = islab;
-                    break;
-                }
+    if (slab == NULL || slab_full(slab)) {
+        slab = NULL;
+        list_foreach(oc->slabs, slab_t, islab)
+        {
+            if (!slab_full(islab)) {
+                slab = islab;
+                break;
             }
+        }
 
-            if (oc->last_free == NULL) {
-                slab = slab_create(oc, oc->section);
+        if (slab == NULL) {
+            slab = slab_create(oc, oc->section);
+            if (slab != NULL) {
                 list_push(&oc->slabs, &slab->header.next);
             }
+        }
+
+        oc->last_free = slab;
+    }
+
+    if (slab != NULL && slab_empty(slab) && oc->empty > 0) {
+        oc->empty--;
+    }
 
-            oc->last_free = slab;
+    return slab_alloc(slab);
+}
+
+/**
+ * Return an object to its slab. Must be called with the cache lock held.
+ */
+static bool objcache_slab_free(objcache_t* oc, void* obj)
+{
+    slab_t* slab = slab_get(obj);
+
+    if (slab == NULL || slab->header.cache != oc) {
+        return false;
+    }
+
+    if (!slab_free(slab, obj)) {
+        return false;
+    }
+
+    if (slab_empty(slab)) {
+        if (oc->empty < OBJCACHE_EMPTY_MAX) {
+            oc->empty++;
         } else {
-            slab = oc->last_free;
+            list_rm(&oc->slabs, &slab->header.next);
+            if (oc->last_free == slab) oc->last_free = NULL;
+            mem_free_vpage(&cpu.as, slab, 1, true);
         }
+    }
 
-        if (slab != NULL) {
-            object = slab_alloc(slab);
+    return true;
+}
+
+/**
+ * Get this CPU's magazine for the cache, claiming a free one if it has none
+ * yet. Returns NULL if the cache does not use magazines or all of this CPU's
+ * magazines are taken.
+ */
+static objcache_mag_t* objcache_mag(objcache_t* oc)
+{
+    objcache_mag_t* free_mag = NULL;
+
+    if (!(oc->flags & OBJCACHE_MAG)) return NULL;
+
+    for (size_t i = 0; i < OBJCACHE_MAG_NUM; i++) {
+        objcache_mag_t* mag = &cpu.oc_mags[i];
+        if (mag->oc == oc) {
+            return mag;
+        } else if (mag->oc == NULL && free_mag == NULL) {
+            free_mag = mag;
+        }
+    }
+
+    if (free_mag != NULL) {
+        free_mag->oc = oc;
+        free_mag->count = 0;
+    }
+
+    return free_mag;
+}
+
+void* objcache_alloc(objcache_t* oc)
+{
+    void* object = NULL;
+
+    if (oc != NULL) {
+        objcache_mag_t* mag = objcache_mag(oc);
+
+        if (mag != NULL && mag->count > 0) {
+            return mag->objs[--mag->count];
+        }
+
+        spin_lock_class(&oc->lock, SPINLOCK_CLASS_OBJCACHE);
+
+        if (mag != NULL) {
+            /* refill the magazine with a batch, keep the last one */
+            while (mag->count < OBJCACHE_MAG_BATCH) {
+                void* obj = objcache_slab_alloc(oc);
+                if (obj == NULL) break;
+                mag->objs[mag->count++] = obj;
+            }
+            if (mag->count > 0) {
+                object = mag->objs[--mag->count];
+            }
+        } else {
+            object = objcache_slab_alloc(oc);
         }
 
         spin_unlock(&oc->lock);
@@ -171,29 +283,95 @@ void* objcache_alloc(objcache_t* oc)
 
 bool objcache_free(objcache_t* oc, void* obj)
 {
-    slab_t* slab = NULL;
     bool ret = false;
 
     if (oc != NULL) {
-        spin_lock(&oc->lock);
+        objcache_mag_t* mag = objcache_mag(oc);
 
-        slab = slab_get(obj);
+        if (mag != NULL && slab_get(obj)->header.cache == oc) {
+            /**
+             * Run the slab's ownership check before caching the object, and
+             * make sure it is not in the magazine already.
+             */
+            bool valid = slab_obj_valid(slab_get(obj), obj);
+            for (size_t i = 0; valid && i < mag->count; i++) {
+                valid = (mag->objs[i] != obj);
+            }
+            if (!valid) {
+                WARNING("invalid or double free of object 0x%lx",
+                        (uint64_t)obj);
+                return false;
+            }
 
-        if (slab != NULL) {
-            if (slab->header.cache == oc) {
-                if (slab_free(slab, obj)) {
-                    if (slab_empty(slab)) {
-                        // TODO: deallocate slab page
-                    }
-                    ret = true;
-                } else {
-                    ret = true;
+            if (mag->count == OBJCACHE_MAG_SIZE) {
+                /* drain the older half of the magazine back to the slabs */
+                spin_lock_class(&oc->lock, SPINLOCK_CLASS_OBJCACHE);
+                for (size_t i = 0; i < OBJCACHE_MAG_BATCH; i++) {
+                    objcache_slab_free(oc, mag->objs[i]);
+                }
+                spin_unlock(&oc->lock);
+                for (size_t i = OBJCACHE_MAG_BATCH; i < mag->count; i++) {
+                    mag->objs[i - OBJCACHE_MAG_BATCH] = mag->objs[i];
                 }
+                mag->count -= OBJCACHE_MAG_BATCH;
+            }
+            if (!(oc->flags & OBJCACHE_NOZERO)) {
+                memset(obj, 0, oc->osize);
             }
+            mag->objs[mag->count++] = obj;
+            return true;
         }
 
+        spin_lock_class(&oc->lock, SPINLOCK_CLASS_OBJCACHE);
+        ret = objcache_slab_free(oc, obj);
         spin_unlock(&oc->lock);
     }
 
     return ret;
 }
+
+void objcache_std_init()
+{
+    for (size_t i = 0; i < sizeof(std_objcache_sizes) / sizeof(size_t); i++) {
+        objcache_init(&std_objcache_list[i], std_objcache_sizes[i],
+                      SEC_HYP_GLOBAL, 0);
+    }
+}
+
+static objcache_t* objcache_std_get(size_t size)
+{
+    for (size_t i = 0; i < sizeof(std_objcache_sizes) / sizeof(size_t); i++) {
+        if (size <= std_objcache_sizes[i]) {
+            return &std_objcache_list[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocates zeroed memory for a small hypervisor object from the size class
+ * caches, or whole global pages if it is bigger than the largest class.
+ */
+void* objcache_std_alloc(size_t size)
+{
+    objcache_t* oc = objcache_std_get(size);
+    if (oc != NULL) {
+        return objcache_alloc(oc);
+    }
+
+    void* obj = mem_alloc_page(NUM_PAGES(size), SEC_HYP_GLOBAL, false);
+    if (obj != NULL) {
+        memset(obj, 0, NUM_PAGES(size) * PAGE_SIZE);
+    }
+    return obj;
+}
+
+void objcache_std_free(void* obj, size_t size)
+{
+    objcache_t* oc = objcache_std_get(size);
+    if (oc != NULL) {
+        objcache_free(oc, obj);
+    } else {
+        mem_free_vpage(&cpu.as, obj, NUM_PAGES(size), true);
+    }
+}
@@ -14,6 +14,7 @@
 ##
 
 core-objs-y+=init.o
+core-objs-y+=alternative.o
 core-objs-y+=mem.o
 core-objs-y+=objcache.o
 core-objs-y+=cache.o
@@ -25,3 +26,6 @@ core-objs-y+=config.o
 core-objs-y+=console.o
 core-objs-y+=iommu.o
 core-objs-y+=ipc.o
+core-objs-y+=balloon.o
+core-objs-y+=stats.o
+core-objs-y+=trace.o
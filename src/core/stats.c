@@ -0,0 +1,148 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#include <stats.h>
+
+#include <cpu.h>
+#include <vm.h>
+#include <mem.h>
+#include <hypercall.h>
+#include <platform.h>
+#include <string.h>
+
+#ifdef BAO_STATS
+
+vcpu_stats_t* stats_table;
+
+/**
+ * Allocates the table in global memory, so any cpu can snapshot it. Called
+ * by the master cpu before any vm runs.
+ */
+void stats_init()
+{
+    size_t n = NUM_PAGES(sizeof(vcpu_stats_t) * platform.cpu_num);
+
+    stats_table = mem_alloc_page(n, SEC_HYP_GLOBAL, false);
+    if (stats_table == NULL) ERROR("cant allocate stats table");
+    memset(stats_table, 0, n * PAGE_SIZE);
+
+    for (size_t i = 0; i < platform.cpu_num; i++) {
+        stats_table[i].vm_id = STATS_NO_VM;
+    }
+}
+
+void stats_vcpu_init(uint64_t vm_id, uint64_t vcpu_id)
+{
+    stats_table[cpu.id].vm_id = vm_id;
+    stats_table[cpu.id].vcpu_id = vcpu_id;
+}
+
+/**
+ * Whether [addr, addr + size) lies inside a single one of the vm's memory
+ * regions, so the buffer can't be device memory or memory shared with
+ * other vms.
+ */
+static bool stats_buf_in_vm_mem(vm_t* vm, uint64_t addr, size_t size)
+{
+    const vm_config_t* config = vm->config;
+
+    for (int i = 0; i < config->platform.region_num; i++) {
+        struct mem_region* reg = &config->platform.regions[i];
+        if (addr >= reg->base && addr - reg->base < reg->size &&
+            size <= reg->size - (addr - reg->base)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Copies size bytes from src to the guest buffer at addr, a page at a time,
+ * as the buffer need not be physically contiguous. Pages not populated yet
+ * are populated first. The vm lock is held while a page is written, so the
+ * guest can't release it through the balloon in the meantime.
+ */
+static bool stats_copy_to_vm(vm_t* vm, uint64_t addr, void* src, size_t size)
+{
+    while (size > 0) {
+        uint64_t pa = 0;
+        size_t off = addr & (PAGE_SIZE - 1);
+        size_t len = min(size, PAGE_SIZE - off);
+
+        if (!vm_mem_populate(vm, addr)) return false;
+
+        spin_lock(&vm->lock);
+        bool mapped = vm_mem_translate(vm, addr, &pa);
+        if (mapped) {
+            ppages_t pp = mem_ppages_get(pa & ~(PAGE_SIZE - 1), 1);
+            void* va = mem_alloc_vpage(&cpu.as, SEC_HYP_PRIVATE, NULL, 1);
+            mem_map(&cpu.as, va, &pp, 1, PTE_HYP_FLAGS);
+            memcpy(va + off, src, len);
+            mem_free_vpage(&cpu.as, va, 1, false);
+        }
+        spin_unlock(&vm->lock);
+        if (!mapped) return false;
+
+        addr += len;
+        src += len;
+        size -= len;
+    }
+
+    return true;
+}
+
+/**
+ * Copies a snapshot of the statistics to the guest buffer at arg0 of arg1
+ * bytes, which must fit the header and all entries and lie in one of the
+ * vm's memory regions. A vm only gets the
+ * entries of its own vcpus, unless it is configured as a stats monitor.
+ */
+int64_t stats_hypercall(uint64_t arg0, uint64_t arg1, uint64_t arg2)
+{
+    vm_t* vm = cpu.vcpu->vm;
+    uint64_t addr = arg0;
+    size_t size = arg1;
+    stats_hdr_t hdr = {
+        .cpu_num = platform.cpu_num,
+        .entry_size = sizeof(vcpu_stats_t),
+        .cpu_mask = 0,
+    };
+
+    if ((addr % sizeof(uint64_t)) != 0 ||
+        size < sizeof(hdr) + hdr.cpu_num * hdr.entry_size ||
+        !stats_buf_in_vm_mem(vm, addr, size)) {
+        return -HC_E_INVAL_ARGS;
+    }
+
+    for (size_t i = 0; i < platform.cpu_num; i++) {
+        if (vm->config->stats_monitor || stats_table[i].vm_id == vm->id) {
+            uint64_t entry = addr + sizeof(hdr) + i * hdr.entry_size;
+            if (!stats_copy_to_vm(vm, entry, &stats_table[i],
+                                  hdr.entry_size)) {
+                return -HC_E_INVAL_ARGS;
+            }
+            hdr.cpu_mask |= 1ULL << i;
+        }
+    }
+
+    if (!stats_copy_to_vm(vm, addr, &hdr, sizeof(hdr))) {
+        return -HC_E_INVAL_ARGS;
+    }
+
+    return HC_E_SUCCESS;
+}
+
+#endif
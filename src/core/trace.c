@@ -0,0 +1,75 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Authors:
+ *      Jose Martins <jose.martins@bao-project.org>
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+#include <trace.h>
+
+#include <cpu.h>
+#include <mem.h>
+#include <vm.h>
+#include <platform.h>
+#include <string.h>
+
+void* trace_base;
+size_t trace_ring_size;
+size_t trace_rec_num;
+
+/**
+ * Maps the trace region in the hypervisor's global address space and
+ * initializes the rings. Called by the master cpu once the shared memory
+ * regions are allocated, and before the other cpus trace anything.
+ */
+void trace_init()
+{
+    shmem_t* shmem = NULL;
+
+    for (size_t i = 0; i < vm_config_ptr->shmemlist_size; i++) {
+        if (vm_config_ptr->shmemlist[i].trace) {
+            shmem = &vm_config_ptr->shmemlist[i];
+            break;
+        }
+    }
+
+    if (shmem == NULL) return;
+
+    size_t n = NUM_PAGES(shmem->size);
+    size_t ring_size = (n * PAGE_SIZE / platform.cpu_num) &
+                       ~(sizeof(trace_rec_t) - 1);
+    if (ring_size <= sizeof(trace_ring_t)) {
+        WARNING("trace region too small, tracing disabled");
+        return;
+    }
+
+    ppages_t pp = mem_ppages_get(shmem->phys, n);
+    pp.colors = shmem->colors;
+    void* va = mem_alloc_vpage(&cpu.as, SEC_HYP_GLOBAL, NULL, n);
+    if (va == NULL || mem_map(&cpu.as, va, &pp, n, PTE_HYP_FLAGS)) {
+        ERROR("failed to map trace region");
+    }
+    memset(va, 0, n * PAGE_SIZE);
+
+    trace_ring_size = ring_size;
+    trace_rec_num = (ring_size - sizeof(trace_ring_t)) / sizeof(trace_rec_t);
+
+    for (size_t i = 0; i < platform.cpu_num; i++) {
+        trace_ring_t* ring = va + i * ring_size;
+        ring->magic = TRACE_MAGIC;
+        ring->cpu = i;
+        ring->rec_num = trace_rec_num;
+        ring->freq = timer_arch_freq();
+    }
+
+    fence_ord_write();
+    trace_base = va;
+}
@@ -18,6 +18,8 @@
 #include <string.h>
 #include <mem.h>
 #include <cache.h>
+#include <timer.h>
+#include <stats.h>
 
 enum emul_type {EMUL_MEM, EMUL_REG};
 struct emul_node {
@@ -41,7 +43,7 @@ static void vm_master_init(vm_t* vm, const vm_config_t* config, uint64_t vm_id)
     as_init(&vm->as, AS_VM, vm_id, NULL, config->colors);
 
     list_init(&vm->emul_list);
-    objcache_init(&vm->emul_oc, sizeof(struct emul_node), SEC_HYP_VM, false);
+    objcache_init(&vm->emul_oc, sizeof(struct emul_node), SEC_HYP_VM, 0);
 }
 
 void vm_cpu_init(vm_t* vm)
@@ -79,6 +81,8 @@ void vm_vcpu_init(vm_t* vm, const vm_config_t* config)
     vcpu->regs = (struct arch_regs*)(vcpu->stack + sizeof(vcpu->stack) -
                                      sizeof(*vcpu->regs));
 
+    stats_vcpu_init(vm->id, vcpu->id);
+
     vcpu_arch_init(vcpu, vm);
     vcpu_arch_reset(vcpu, config->entry);
 
@@ -105,9 +109,24 @@ static void vm_copy_img_to_rgn(vm_t* vm, const vm_config_t* config,
         ERROR("mem_map failed %s", __func__);
     }
 
-    memcpy(dst_va, src_va, n_img * PAGE_SIZE);
-    cache_flush_range(dst_va, n_img * PAGE_SIZE);
-    /*TODO: unmap */
+    /* the copy itself is shared by all the vm's cpus, see vm_copy_img */
+    vm->img_copy.src = src_va;
+    vm->img_copy.dst = dst_va;
+    vm->img_copy.size = n_img * PAGE_SIZE;
+}
+
+/**
+ * Lazily populated regions are mapped in chunks of this many pages, on the
+ * first guest access to each chunk.
+ */
+#define VM_LAZY_CHUNK (16)
+
+static inline bool vm_mem_region_is_lazy(const vm_config_t* config,
+                                         struct mem_region* reg)
+{
+    return reg->lazy && !reg->place_phys &&
+           !range_in_range(config->image.base_addr, config->image.size,
+                           reg->base, reg->size);
 }
 
 void vm_map_mem_region(vm_t* vm, struct mem_region* reg)
@@ -118,11 +137,37 @@ void vm_map_mem_region(vm_t* vm, struct mem_region* reg)
         ERROR("failed to allocate vm's dev address");
     }
 
-    if (reg->place_phys) {
+    if (vm_mem_region_is_lazy(vm->config, reg)) {
+        /* only reserve it, pages are mapped on demand by vm_mem_populate */
+        vm_lazy_t* lazy = &vm->lazy[vm->lazy_num++];
+        size_t chunks = (n + VM_LAZY_CHUNK - 1) / VM_LAZY_CHUNK + 1;
+        lazy->reg = reg;
+        lazy->ppages = mem_alloc_ppages(vm->as.colors, n, false);
+        if (lazy->ppages.size < n) {
+            ERROR("failed to reserve vm's memory");
+        }
+        size_t bitmap_pages = NUM_PAGES(ALIGN(chunks, 8) / 8);
+        lazy->populated = mem_alloc_page(bitmap_pages, SEC_HYP_VM, false);
+        if (lazy->populated == NULL) {
+            ERROR("failed to allocate vm's lazy memory bitmap");
+        }
+        memset(lazy->populated, 0, bitmap_pages * PAGE_SIZE);
+    } else if (reg->place_phys) {
         ppages_t pa_reg = mem_ppages_get(reg->phys, n);
         mem_map(&vm->as, va, &pa_reg, n, PTE_VM_FLAGS);
     } else {
-        mem_map(&vm->as, va, NULL, n, PTE_VM_FLAGS);
+        /**
+         * Back the whole region with memory aligned as much as its ipa
+         * allows, so it can be mapped with the largest blocks possible.
+         * Otherwise let mem_map allocate it block by block.
+         */
+        size_t align = mem_blk_align(reg->base, n);
+        ppages_t ppages = {.size = 0};
+        if (all_clrs(vm->as.colors) && align > 1) {
+            ppages = mem_alloc_ppages_aligned(vm->as.colors, n, align);
+        }
+        mem_map(&vm->as, va, ppages.size == n ? &ppages : NULL, n,
+                PTE_VM_FLAGS);
     }
 }
 
@@ -154,8 +199,9 @@ static void vm_map_img_rgn_inplace(vm_t* vm, const vm_config_t* config,
         /* we are mapping in place, config is already reserved */
     } else {
         /* recolour img */
-        mem_map_reclr(&vm->as, va + n_before * PAGE_SIZE, &pa_img, n_img,
-                      PTE_VM_FLAGS);
+        mem_map_reclr_start(&vm->img_copy.reclr, &vm->as,
+                            va + n_before * PAGE_SIZE, &pa_img, n_img,
+                            PTE_VM_FLAGS);
         /* TODO: reserve phys mem? */
     }
     /* map pages after img */
@@ -176,6 +222,20 @@ static void vm_map_img_rgn(vm_t* vm, const vm_config_t* config,
 
 static void vm_init_mem_regions(vm_t* vm, const vm_config_t* config)
 {
+    size_t lazy_num = 0;
+    for (int i = 0; i < config->platform.region_num; i++) {
+        if (vm_mem_region_is_lazy(config, &config->platform.regions[i])) {
+            lazy_num++;
+        }
+    }
+    if (lazy_num > 0) {
+        vm->lazy = mem_alloc_page(NUM_PAGES(lazy_num * sizeof(vm_lazy_t)),
+                                  SEC_HYP_VM, false);
+        if (vm->lazy == NULL) {
+            ERROR("failed to allocate vm's lazy regions");
+        }
+    }
+
     for (int i = 0; i < config->platform.region_num; i++) {
         struct mem_region* reg = &config->platform.regions[i];
         int img_is_in_rgn = range_in_range(
@@ -216,6 +276,19 @@ static void vm_init_ipc(vm_t* vm, const vm_config_t* config)
     }
 }
 
+static void vm_init_balloon(vm_t* vm, const vm_config_t* config)
+{
+    if (config->balloon.size == 0) return;
+
+    /* only reserve the window, pages are claimed at runtime */
+    size_t n = NUM_PAGES(config->balloon.size);
+    void* va = mem_alloc_vpage(&vm->as, SEC_VM_ANY,
+                               (void*)config->balloon.base, n);
+    if (va != (void*)config->balloon.base) {
+        ERROR("failed to allocate vm's balloon window");
+    }
+}
+
 static void vm_init_dev(vm_t* vm, const vm_config_t* config)
 {
     for (int i = 0; i < config->platform.dev_num; i++) {
@@ -245,6 +318,42 @@ static void vm_init_dev(vm_t* vm, const vm_config_t* config)
       
 }
 
+/**
+ * Each of the vm's cpus copies and flushes an equal share of the image pages
+ * left pending by the master when it mapped the vm's memory regions.
+ */
+static void vm_copy_img(vm_t* vm)
+{
+    size_t part = cpu.vcpu->id;
+    size_t parts = vm->cpu_num;
+
+    size_t n = NUM_PAGES(vm->img_copy.size);
+    size_t off = n * part / parts * PAGE_SIZE;
+    size_t size = n * (part + 1) / parts * PAGE_SIZE - off;
+    if (size > 0) {
+        memcpy(vm->img_copy.dst + off, vm->img_copy.src + off, size);
+        cache_flush_range(vm->img_copy.dst + off, size);
+    }
+
+    mem_map_reclr_copy(&vm->img_copy.reclr, part, parts);
+}
+
+/**
+ * Once all the vm's cpus are done copying, releases the temporary hypervisor
+ * mappings of the image and, when recoloring, its uncolored pages.
+ */
+static void vm_copy_img_finish(vm_t* vm)
+{
+    if (vm->img_copy.size > 0) {
+        size_t n = NUM_PAGES(vm->img_copy.size);
+        mem_free_vpage(&cpu.as, vm->img_copy.src, n, false);
+        mem_free_vpage(&cpu.as, vm->img_copy.dst, n, false);
+        vm->img_copy.size = 0;
+    }
+
+    mem_map_reclr_finish(&vm->img_copy.reclr);
+}
+
 /*
     读取配置，初始化某个VM
 */
@@ -282,15 +391,190 @@ void vm_init(vm_t* vm, const vm_config_t* config, bool master, uint64_t vm_id)
      * Create the VM's address space according to configuration and where
      * its image was loaded.
      */
+    uint64_t t_start = 0, t_map = 0, t_copy = 0;
     if (master) {
+        t_start = timer_get();
         vm_init_mem_regions(vm, config);
         vm_init_dev(vm, config);
         vm_init_ipc(vm, config);
+        vm_init_balloon(vm, config);
+        t_map = timer_get();
+    }
+
+    cpu_sync_barrier(&vm->sync);
+
+    /**
+     * Copy and recolor the image, split among all the vm's cpus.
+     */
+    vm_copy_img(vm);
+
+    cpu_sync_barrier(&vm->sync);
+
+    if (master) {
+        t_copy = timer_get();
+        vm_copy_img_finish(vm);
+        uint64_t t_end = timer_get();
+        INFO("VM %ld: image map %ld us, copy %ld us (%ld cpus), cleanup %ld us",
+             vm->id, timer_ticks_to_us(t_map - t_start),
+             timer_ticks_to_us(t_copy - t_map), vm->cpu_num,
+             timer_ticks_to_us(t_end - t_copy));
+#ifdef BAO_STATS
+        mem_map_report(&vm->as);
+#endif
     }
 
     cpu_sync_barrier(&vm->sync);
 }
 
+/**
+ * Walks the vm's stage-2 table to find the physical address addr is mapped
+ * to, if any.
+ */
+bool vm_mem_translate(vm_t* vm, uint64_t addr, uint64_t* pa)
+{
+    for (size_t lvl = 0; lvl < vm->as.pt.dscr->lvls; lvl++) {
+        pte_t* pte = pt_get_pte(&vm->as.pt, lvl, (void*)addr);
+        if (pte == NULL || !pte_valid(pte)) return false;
+        if (!pte_table(&vm->as.pt, pte, lvl)) {
+            if (pa != NULL) {
+                uint64_t lvlsz = pt_lvlsize(&vm->as.pt, lvl);
+                *pa = pte_addr(pte) | (addr & (lvlsz - 1));
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Maps n zeroed pages of the vm's colors at addr, taken from ppages or newly
+ * allocated if it is NULL. The pages are zeroed and cleaned through a
+ * temporary hypervisor mapping before the guest can see them. Must be called
+ * with the vm lock held.
+ */
+int vm_mem_map_zeroed(vm_t* vm, uint64_t addr, ppages_t* ppages, size_t n)
+{
+    ppages_t new_pp = {.size = 0};
+    if (ppages == NULL) {
+        /**
+         * A full aligned run can be mapped with the contiguous hint. Aligned
+         * allocations ignore colors, so colored vms never ask for them.
+         */
+        bool aligned = all_clrs(vm->as.colors) && (PTE_CONTIG_NUM > 1) &&
+                       (n == PTE_CONTIG_NUM);
+        new_pp = mem_alloc_ppages(vm->as.colors, n, aligned);
+        if (new_pp.size < n) {
+            new_pp = mem_alloc_ppages(vm->as.colors, n, false);
+        }
+        if (new_pp.size < n) {
+            return -1;
+        }
+        ppages = &new_pp;
+    }
+
+    void* va = mem_alloc_vpage(&cpu.as, SEC_HYP_PRIVATE, NULL, n);
+    mem_map(&cpu.as, va, ppages, n, PTE_HYP_FLAGS);
+    memset(va, 0, n * PAGE_SIZE);
+    cache_flush_range(va, n * PAGE_SIZE);
+    mem_free_vpage(&cpu.as, va, n, false);
+
+    return mem_map(&vm->as, (void*)addr, ppages, n, PTE_VM_FLAGS);
+}
+
+static vm_lazy_t* vm_mem_lazy_region(vm_t* vm, uint64_t addr)
+{
+    for (size_t i = 0; i < vm->lazy_num; i++) {
+        struct mem_region* reg = vm->lazy[i].reg;
+        if (addr >= reg->base && addr - reg->base < reg->size) {
+            return &vm->lazy[i];
+        }
+    }
+    return NULL;
+}
+
+bool vm_mem_is_lazy(vm_t* vm, uint64_t addr)
+{
+    return vm_mem_lazy_region(vm, addr) != NULL;
+}
+
+/**
+ * Whether addr is in the vm's own memory, i.e., in one of its regions not
+ * placed at a fixed physical address or in its balloon window. Only the
+ * config is read, so no lock is needed.
+ */
+bool vm_mem_is_ram(vm_t* vm, uint64_t addr)
+{
+    const vm_config_t* config = vm->config;
+
+    if (addr >= config->balloon.base &&
+        addr - config->balloon.base < config->balloon.size) {
+        return true;
+    }
+
+    for (int i = 0; i < config->platform.region_num; i++) {
+        struct mem_region* reg = &config->platform.regions[i];
+        if (!reg->place_phys && addr >= reg->base &&
+            addr - reg->base < reg->size) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Handles a stage-2 fault on the vm's own memory at addr. The first access
+ * to a chunk of a lazily populated region maps the chunk with its reserved
+ * pages. Pages released since through the balloon are backed by newly
+ * allocated ones. Returns false if addr can not be backed, i.e., it was
+ * released from a region that is not lazy or not claimed in the balloon
+ * window, or no free pages are left, so the fault must be reflected to the
+ * guest.
+ */
+bool vm_mem_populate(vm_t* vm, uint64_t addr)
+{
+    bool ret = true;
+
+    spin_lock(&vm->lock);
+
+    /**
+     * The fault might be spurious, raised while a contiguous run was being
+     * broken up, or another vcpu might have populated it in the meantime.
+     * The access just needs to be replayed.
+     */
+    spin_lock(&vm->as.lock);
+    bool mapped = vm_mem_translate(vm, addr, NULL);
+    spin_unlock(&vm->as.lock);
+
+    vm_lazy_t* lazy = mapped ? NULL : vm_mem_lazy_region(vm, addr);
+    if (lazy != NULL) {
+        struct mem_region* reg = lazy->reg;
+        uint64_t chunk_sz = VM_LAZY_CHUNK * PAGE_SIZE;
+        uint64_t chunk_base = addr & ~(chunk_sz - 1);
+        size_t chunk = (chunk_base - (reg->base & ~(chunk_sz - 1))) / chunk_sz;
+
+        if (!bitmap_get(lazy->populated, chunk)) {
+            /* none of the chunk's pages were mapped yet */
+            uint64_t base = max(chunk_base, reg->base);
+            uint64_t end = min(chunk_base + chunk_sz, reg->base + reg->size);
+            size_t n = NUM_PAGES(end - base);
+            ppages_t ppages = mem_ppages_offset(
+                &lazy->ppages, (base - reg->base) / PAGE_SIZE, n);
+            ret = vm_mem_map_zeroed(vm, base, &ppages, n) >= 0;
+            bitmap_set(lazy->populated, chunk);
+        } else {
+            /* released through the balloon, it needs a new page */
+            ret = vm_mem_map_zeroed(vm, addr & ~(PAGE_SIZE - 1), NULL, 1) >= 0;
+        }
+    } else if (!mapped) {
+        ret = false;
+    }
+
+    spin_unlock(&vm->lock);
+
+    return ret;
+}
+
 vcpu_t* vm_get_vcpu(vm_t* vm, uint64_t vcpuid)
 {
     list_foreach(vm->vcpu_list, vcpu_t, vcpu)
@@ -365,12 +649,7 @@ emul_handler_t vm_emul_get_reg(vm_t* vm, uint64_t addr)
 
 void vm_msg_broadcast(vm_t* vm, cpu_msg_t* msg)
 {
-    for (int i = 0, n = 0; n < vm->cpu_num - 1; i++) {
-        if (((1U << i) & vm->cpus) && (i != cpu.id)) {
-            n++;
-            cpu_send_msg(i, msg);
-        }
-    }
+    cpu_send_msg_mask(vm->cpus & ~(1ULL << cpu.id), msg);
 }
 
 __attribute__((weak)) uint64_t vm_translate_to_pcpu_mask(vm_t* vm,
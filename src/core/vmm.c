@@ -23,6 +23,7 @@
 #include <fences.h>
 #include <string.h>
 #include <ipc.h>
+#include <stats.h>
 
 struct config* vm_config_ptr;  //  指向VMM的配置
 
@@ -45,17 +46,14 @@ void vmm_init()
         pte_t vm_shared_table;
     } * vm_assign;
 
-    size_t vmass_npages = 0; // TODO: 具体是什么大小?
+    size_t vmass_size =
+        sizeof(struct vm_assignment) * vm_config_ptr->vmlist_size;
     if (cpu.id == CPU_MASTER) {
         iommu_init();
+        stats_init();
 
-        vmass_npages =
-            ALIGN(sizeof(struct vm_assignment) * vm_config_ptr->vmlist_size,
-                  PAGE_SIZE) /
-            PAGE_SIZE;
-        vm_assign = mem_alloc_page(vmass_npages, SEC_HYP_GLOBAL, false);
-        if (vm_assign == NULL) ERROR("cant allocate vm assignemnt pages");
-        memset((void*)vm_assign, 0, vmass_npages * PAGE_SIZE);
+        vm_assign = objcache_std_alloc(vmass_size);
+        if (vm_assign == NULL) ERROR("cant allocate vm assignemnt");
     }
 
     cpu_sync_barrier(&cpu_glb_sync);
@@ -142,13 +140,27 @@ void vmm_init()
     cpu_sync_barrier(&cpu_glb_sync);
 
     if (cpu.id == CPU_MASTER) {
-        mem_free_vpage(&cpu.as, (void*)vm_assign, vmass_npages, true);
+        objcache_std_free((void*)vm_assign, vmass_size);
+#ifdef BAO_STATS
+        mem_string_bench();
+#endif
     }
 
+#ifdef BAO_STATS
+    cpu_msg_bench();
+    cpu_sync_bench();
+#endif
+
     ipc_init(vm_config, master);
 
     if (assigned) {
         vm_init((void*)BAO_VM_BASE, vm_config, master, vm_id);
+#ifdef BAO_STATS
+        mem_stats_report();
+        cpu_lock_stats_report();
+        mem_pt_stats_report(&cpu.as);
+        if (master) mem_pt_stats_report(&cpu.vcpu->vm->as);
+#endif
         vcpu_run(cpu.vcpu);
     } else {
         cpu_idle();
@@ -15,18 +15,37 @@
 
 #include <bitmap.h>
 
+/**
+ * The search primitives below scan the bitmap one granule at a time, only
+ * looking at individual bits within the granule where the search ends.
+ */
+
+static inline bitmap_granule_t bitmap_granule(bitmap_t map, size_t g, bool set)
+{
+    return set ? map[g] : ~map[g];
+}
+
 int64_t bitmap_find_nth(bitmap_t map, size_t size, size_t nth, size_t start,
                         bool set)
 {
-    if (size <= 0 || nth <= 0 || start < 0) return -1;
+    if (size <= 0 || nth <= 0 || start >= size) return -1;
 
     size_t count = 0;
-    uint64_t bit = set ? 1 : 0;
+    size_t last = (size - 1) / BITMAP_GRANULE_LEN;
 
-    for (size_t i = start; i < size; i++) {
-        if (bitmap_get(map, i) == bit) {
-            if (++count == nth) return i;
+    for (size_t g = start / BITMAP_GRANULE_LEN; g <= last; g++) {
+        bitmap_granule_t word = bitmap_granule(map, g, set) &
+                                bitmap_granule_mask(g, start, size - start);
+        size_t pop = bit_popcount(word);
+
+        if (count + pop >= nth) {
+            for (size_t i = count + 1; i < nth; i++) {
+                word &= word - 1;
+            }
+            return (g * BITMAP_GRANULE_LEN) + bit_ctz(word);
         }
+
+        count += pop;
     }
 
     return -1;
@@ -37,17 +56,24 @@ size_t bitmap_count_consecutive(bitmap_t map, size_t size, size_t start,
 {
     if (n <= 1) return n;
 
-    uint8_t b = bitmap_get(map, start);
+    bool b = bitmap_get(map, start);
     size_t count = 1;
     start += 1;
 
     while (start < size) {
-        if (bitmap_get(map, start) == b)
-            count++;
-        else
-            break;
-        if (count == n) break;
-        start++;
+        size_t off = start % BITMAP_GRANULE_LEN;
+        size_t avail = BITMAP_GRANULE_LEN - off;
+        if (avail > size - start) avail = size - start;
+
+        bitmap_granule_t word =
+            bitmap_granule(map, start / BITMAP_GRANULE_LEN, !b) >> off;
+        size_t run = bit_ctz(word);
+        if (run > avail) run = avail;
+
+        count += run;
+        if (count >= n) return n;
+        if (run < avail) break;
+        start += run;
     }
 
     return count;
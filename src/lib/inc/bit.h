@@ -28,8 +28,57 @@
 
 #ifndef __ASSEMBLER__
 
-size_t bit_ctz(uint64_t n);
-size_t bit_clz(uint64_t n);
+/**
+ * Count trailing/leading zeros and set bits of a 64-bit word. A zero word has
+ * 64 trailing and leading zeros. The compiler builtins are only used when the
+ * target has native instructions for them, as the hypervisor is not linked
+ * against libgcc.
+ */
+static inline size_t bit_ctz(uint64_t n)
+{
+#if defined(__ARM_FEATURE_CLZ) || defined(__riscv_zbb)
+    return n ? __builtin_ctzll(n) : 64;
+#else
+    size_t count = 0;
+    if (n == 0) return 64;
+    if (!(n & 0xffffffffULL)) { count += 32; n >>= 32; }
+    if (!(n & 0xffffULL)) { count += 16; n >>= 16; }
+    if (!(n & 0xffULL)) { count += 8; n >>= 8; }
+    if (!(n & 0xfULL)) { count += 4; n >>= 4; }
+    if (!(n & 0x3ULL)) { count += 2; n >>= 2; }
+    if (!(n & 0x1ULL)) { count += 1; }
+    return count;
+#endif
+}
+
+static inline size_t bit_clz(uint64_t n)
+{
+#if defined(__ARM_FEATURE_CLZ) || defined(__riscv_zbb)
+    return n ? __builtin_clzll(n) : 64;
+#else
+    size_t count = 0;
+    if (n == 0) return 64;
+    if (!(n & 0xffffffff00000000ULL)) { count += 32; n <<= 32; }
+    if (!(n & 0xffff000000000000ULL)) { count += 16; n <<= 16; }
+    if (!(n & 0xff00000000000000ULL)) { count += 8; n <<= 8; }
+    if (!(n & 0xf000000000000000ULL)) { count += 4; n <<= 4; }
+    if (!(n & 0xc000000000000000ULL)) { count += 2; n <<= 2; }
+    if (!(n & 0x8000000000000000ULL)) { count += 1; }
+    return count;
+#endif
+}
+
+static inline size_t bit_popcount(uint64_t n)
+{
+#if defined(__riscv_zbb)
+    return __builtin_popcountll(n);
+#else
+    n = n - ((n >> 1) & 0x5555555555555555ULL);
+    n = (n & 0x3333333333333333ULL) + ((n >> 2) & 0x3333333333333333ULL);
+    n = (n + (n >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (n * 0x0101010101010101ULL) >> 56;
+#endif
+}
 
 static inline uint64_t bit_get(uint64_t word, uint64_t off)
 {
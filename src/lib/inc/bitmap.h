@@ -19,9 +19,7 @@
 #include <bao.h>
 #include <bit.h>
 
-/* TODO: needs optimizations */
-
-typedef uint32_t bitmap_granule_t;
+typedef uint64_t bitmap_granule_t;
 typedef bitmap_granule_t* bitmap_t;
 
 static const bitmap_granule_t ONE = 1;
@@ -54,23 +52,50 @@ static inline uint64_t bitmap_get(bitmap_t map, size_t bit)
                : 0U;
 }
 
+/* Mask of the bits of granule g that fall within [start, start + n) */
+static inline bitmap_granule_t bitmap_granule_mask(size_t g, size_t start,
+                                                   size_t n)
+{
+    size_t first = g * BITMAP_GRANULE_LEN;
+    size_t off = (start > first) ? (start - first) : 0;
+    size_t end = start + n - first;
+    size_t len = ((end < BITMAP_GRANULE_LEN) ? end : BITMAP_GRANULE_LEN) - off;
+
+    return BIT_MASK(off, len);
+}
+
 static inline void bitmap_set_consecutive(bitmap_t map, size_t start, size_t n)
 {
-    for (size_t i = 0; i < n; i++) bitmap_set(map, start + i);
+    if (n == 0) return;
+
+    size_t last = (start + n - 1) / BITMAP_GRANULE_LEN;
+    for (size_t g = start / BITMAP_GRANULE_LEN; g <= last; g++) {
+        map[g] |= bitmap_granule_mask(g, start, n);
+    }
 }
 
 static inline void bitmap_clear_consecutive(bitmap_t map, size_t start,
                                             size_t n)
 {
-    for (size_t i = 0; i < n; i++) bitmap_clear(map, start + i);
+    if (n == 0) return;
+
+    size_t last = (start + n - 1) / BITMAP_GRANULE_LEN;
+    for (size_t g = start / BITMAP_GRANULE_LEN; g <= last; g++) {
+        map[g] &= ~bitmap_granule_mask(g, start, n);
+    }
 }
 
-static inline uint64_t bitmap_count(bitmap_t map, size_t start, size_t n,
+/* Number of bits with value set in [start, end) */
+static inline uint64_t bitmap_count(bitmap_t map, size_t start, size_t end,
                                     bool set)
 {
     uint64_t count = 0;
-    for (int i = start; i < n; i++) {
-        if (bitmap_get(map, i) == set) count++;
+    if (end <= start) return 0;
+
+    size_t last = (end - 1) / BITMAP_GRANULE_LEN;
+    for (size_t g = start / BITMAP_GRANULE_LEN; g <= last; g++) {
+        bitmap_granule_t word = set ? map[g] : ~map[g];
+        count += bit_popcount(word & bitmap_granule_mask(g, start, end - start));
     }
 
     return count;
@@ -106,7 +106,13 @@ static inline bool list_rm(list_t* list, node_t node)
         }
         if (temp != NULL && temp == node) {
             /* found the node, remove it */
-            *temp_prev = *temp;
+            if (temp_prev != NULL) {
+                *temp_prev = *temp;
+            } else {
+                list->head = *temp;
+            }
+            if (list->tail == temp) list->tail = temp_prev;
+            *temp = NULL;
         }
 
         spin_unlock(&list->lock);
@@ -23,6 +23,7 @@
 
 void *memcpy(void *dst, const void *src, uint32_t count);
 void *memset(void *dest, uint32_t c, uint32_t count);
+int32_t memcmp(const void *str0, const void *str1, uint32_t count);
 
 char *strcat(char *dest, char *src);
 uint32_t strlen(const char *s);
@@ -14,6 +14,5 @@
 ##
 
 lib-objs-y+=string.o
-lib-objs-y+=bit.o
 lib-objs-y+=printk.o
 lib-objs-y+=bitmap.o
\ No newline at end of file
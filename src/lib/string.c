@@ -15,46 +15,126 @@
 
 #include <string.h>
 
-void *memcpy(void *dst, const void *src, uint32_t count)
+/**
+ * Generic implementations, used where the architecture does not provide
+ * optimized ones. Buffers aligned to each other are handled a word at a time,
+ * eight words per iteration, after aligning them with byte accesses.
+ */
+
+#define WORD_MSK (WORD_SIZE - 1)
+#define WORD_UNROLL (8)
+
+__attribute__((weak)) void *memcpy(void *dst, const void *src, uint32_t count)
 {
-    int32_t i;
     uint8_t *dst_tmp = dst;
     const uint8_t *src_tmp = src;
 
-    if (!((WORD_TYPE)src & (WORD_SIZE - 1)) &&
-        !((WORD_TYPE)dst & (WORD_SIZE - 1))) {
-        for (i = 0; i < count; i += WORD_SIZE) {
-            if (i + (WORD_SIZE - 1) > count - 1) break;
-            *(WORD_TYPE *)dst_tmp = *(WORD_TYPE *)src_tmp;
-            dst_tmp += WORD_SIZE;
-            src_tmp += WORD_SIZE;
+    if ((((WORD_TYPE)dst_tmp ^ (WORD_TYPE)src_tmp) & WORD_MSK) == 0) {
+        while ((count > 0) && ((WORD_TYPE)dst_tmp & WORD_MSK)) {
+            *dst_tmp++ = *src_tmp++;
+            count--;
         }
-        if (i <= count - 1) {
-            for (; i < count; i++) {
-                *dst_tmp = *src_tmp;
-                dst_tmp++;
-                src_tmp++;
-            }
+
+        WORD_TYPE *dst_w = (WORD_TYPE *)dst_tmp;
+        const WORD_TYPE *src_w = (const WORD_TYPE *)src_tmp;
+        while (count >= WORD_UNROLL * WORD_SIZE) {
+            dst_w[0] = src_w[0];
+            dst_w[1] = src_w[1];
+            dst_w[2] = src_w[2];
+            dst_w[3] = src_w[3];
+            dst_w[4] = src_w[4];
+            dst_w[5] = src_w[5];
+            dst_w[6] = src_w[6];
+            dst_w[7] = src_w[7];
+            dst_w += WORD_UNROLL;
+            src_w += WORD_UNROLL;
+            count -= WORD_UNROLL * WORD_SIZE;
+        }
+        while (count >= WORD_SIZE) {
+            *dst_w++ = *src_w++;
+            count -= WORD_SIZE;
         }
-    } else {
-        for (i = 0; i < count; i++) dst_tmp[i] = src_tmp[i];
+
+        dst_tmp = (uint8_t *)dst_w;
+        src_tmp = (const uint8_t *)src_w;
     }
+
+    while (count > 0) {
+        *dst_tmp++ = *src_tmp++;
+        count--;
+    }
+
     return dst;
 }
 
-void *memset(void *dest, uint32_t c, uint32_t count)
+__attribute__((weak)) void *memset(void *dest, uint32_t c, uint32_t count)
 {
-    uint8_t *d;
-    d = (uint8_t *)dest;
+    uint8_t *d = (uint8_t *)dest;
+    WORD_TYPE w = (WORD_TYPE)(uint8_t)c * ((WORD_TYPE)-1 / 0xff);
+
+    while ((count > 0) && ((WORD_TYPE)d & WORD_MSK)) {
+        *d++ = c;
+        count--;
+    }
+
+    WORD_TYPE *d_w = (WORD_TYPE *)d;
+    while (count >= WORD_UNROLL * WORD_SIZE) {
+        d_w[0] = w;
+        d_w[1] = w;
+        d_w[2] = w;
+        d_w[3] = w;
+        d_w[4] = w;
+        d_w[5] = w;
+        d_w[6] = w;
+        d_w[7] = w;
+        d_w += WORD_UNROLL;
+        count -= WORD_UNROLL * WORD_SIZE;
+    }
+    while (count >= WORD_SIZE) {
+        *d_w++ = w;
+        count -= WORD_SIZE;
+    }
 
-    while (count--) {
-        *d = c;
-        d++;
+    d = (uint8_t *)d_w;
+    while (count > 0) {
+        *d++ = c;
+        count--;
     }
 
     return dest;
 }
 
+int32_t memcmp(const void *str0, const void *str1, uint32_t count)
+{
+    const uint8_t *tmp0 = str0;
+    const uint8_t *tmp1 = str1;
+
+    /* Skip equal words, the differing byte is found below */
+    if ((((WORD_TYPE)tmp0 ^ (WORD_TYPE)tmp1) & WORD_MSK) == 0) {
+        while ((count > 0) && ((WORD_TYPE)tmp0 & WORD_MSK)) {
+            if (*tmp0 != *tmp1) return *tmp0 - *tmp1;
+            tmp0++;
+            tmp1++;
+            count--;
+        }
+        while ((count >= WORD_SIZE) &&
+               (*(const WORD_TYPE *)tmp0 == *(const WORD_TYPE *)tmp1)) {
+            tmp0 += WORD_SIZE;
+            tmp1 += WORD_SIZE;
+            count -= WORD_SIZE;
+        }
+    }
+
+    while (count > 0) {
+        if (*tmp0 != *tmp1) return *tmp0 - *tmp1;
+        tmp0++;
+        tmp1++;
+        count--;
+    }
+
+    return 0;
+}
+
 char *strcat(char *dest, char *src)
 {
     char *save = dest;
@@ -14,6 +14,7 @@ struct platform_desc platform = {
 
     .arch = {
         .plic_base = 0xc000000,
+        .timebase_freq = 10000000,
     }
 
 };
\ No newline at end of file
@@ -0,0 +1,171 @@
+/**
+ * Bao, a Lightweight Static Partitioning Hypervisor
+ *
+ * Copyright (c) Bao Project (www.bao-project.org), 2019-
+ *
+ * Bao is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License version 2 as published by the Free
+ * Software Foundation, with a special exception exempting guest code from such
+ * license. See the COPYING file in the top-level directory for details.
+ *
+ */
+
+/**
+ * Host benchmark of the bitmap search primitives used by the page
+ * allocator. It builds the hypervisor's own src/lib/bitmap.c, checks it
+ * against a reference that scans one bit at a time on random bitmaps, and
+ * times both on a nearly full bitmap the size of a 64 GiB page pool.
+ *
+ * Build and run from the top-level directory with:
+ *
+ *   gcc -O2 -Isrc/lib/inc -Isrc/core/inc -Isrc/arch/armv8/inc \
+ *       tools/bitmap_bench.c src/lib/bitmap.c -o bitmap_bench
+ *   ./bitmap_bench
+ */
+
+#include <bitmap.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_BITS (16UL * 1024 * 1024)
+#define BENCH_RUNS (10)
+#define CHECK_BITS (4096)
+#define CHECK_ROUNDS (2000)
+
+static int64_t ref_find_nth(bitmap_t map, size_t size, size_t nth,
+                            size_t start, bool set)
+{
+    size_t count = 0;
+
+    if (size == 0 || nth == 0) return -1;
+
+    for (size_t i = start; i < size; i++) {
+        if (bitmap_get(map, i) == (set ? 1 : 0) && ++count == nth) return i;
+    }
+
+    return -1;
+}
+
+static size_t ref_count_consecutive(bitmap_t map, size_t size, size_t start,
+                                    size_t n)
+{
+    if (n <= 1) return n;
+
+    uint64_t b = bitmap_get(map, start);
+    size_t count = 1;
+
+    for (start++; start < size && count < n; start++) {
+        if (bitmap_get(map, start) != b) break;
+        count++;
+    }
+
+    return count;
+}
+
+static uint64_t ref_find_consec(bitmap_t map, size_t size, size_t start,
+                                size_t n, bool set)
+{
+    int64_t i = ref_find_nth(map, size, 1, start, set);
+
+    if (i < 0) return -1;
+
+    while (i < size) {
+        size_t count = ref_count_consecutive(map, size, i, n);
+        if (count >= n) break;
+        i += count;
+        i += ref_count_consecutive(map, size, i, -1);
+    }
+
+    return (i >= size) ? (uint64_t)-1 : (uint64_t)i;
+}
+
+static uint64_t ref_count(bitmap_t map, size_t start, size_t end, bool set)
+{
+    uint64_t count = 0;
+
+    for (size_t i = start; i < end; i++) {
+        count += bitmap_get(map, i) == (set ? 1 : 0);
+    }
+
+    return count;
+}
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static size_t check()
+{
+    static BITMAP_ALLOC(map, CHECK_BITS);
+    size_t errors = 0;
+
+    for (size_t r = 0; r < CHECK_ROUNDS; r++) {
+        /* vary the density so both short and long runs show up */
+        int density = rand() % 100;
+        for (size_t i = 0; i < CHECK_BITS; i++) {
+            if (rand() % 100 < density) {
+                bitmap_set(map, i);
+            } else {
+                bitmap_clear(map, i);
+            }
+        }
+
+        size_t size = 1 + rand() % CHECK_BITS;
+        size_t start = rand() % size;
+        size_t n = 1 + rand() % 64;
+        bool set = rand() % 2;
+
+        errors += bitmap_find_nth(map, size, n, start, set) !=
+                  ref_find_nth(map, size, n, start, set);
+        errors += bitmap_count_consecutive(map, size, start, n) !=
+                  ref_count_consecutive(map, size, start, n);
+        errors += bitmap_find_consec(map, size, start, n, set) !=
+                  ref_find_consec(map, size, start, n, set);
+        errors += bitmap_count(map, start, size, set) !=
+                  ref_count(map, start, size, set);
+    }
+
+    return errors;
+}
+
+int main()
+{
+    srand(1);
+
+    size_t errors = check();
+    printf("check: %zu mismatches in %d rounds\n", errors, CHECK_ROUNDS);
+
+    /**
+     * Allocated pool: every page taken except for a run of 64 free pages
+     * near the end, the worst case for a first-fit search.
+     */
+    bitmap_t map = calloc(BENCH_BITS / BITMAP_GRANULE_LEN, sizeof(*map));
+    bitmap_set_consecutive(map, 0, BENCH_BITS);
+    bitmap_clear_consecutive(map, BENCH_BITS - 1024, 64);
+
+    double t = now_ms();
+    uint64_t res = 0;
+    for (size_t i = 0; i < BENCH_RUNS; i++) {
+        res = bitmap_find_consec(map, BENCH_BITS, 0, 64, false);
+    }
+    double t_new = (now_ms() - t) / BENCH_RUNS;
+
+    t = now_ms();
+    uint64_t ref = 0;
+    for (size_t i = 0; i < BENCH_RUNS; i++) {
+        ref = ref_find_consec(map, BENCH_BITS, 0, 64, false);
+    }
+    double t_ref = (now_ms() - t) / BENCH_RUNS;
+
+    printf("find_consec on %lu bits: %.2f ms, per-bit reference %.2f ms%s\n",
+           BENCH_BITS, t_new, t_ref, res == ref ? "" : " (MISMATCH)");
+
+    free(map);
+
+    return (errors == 0 && res == ref) ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+#
+# Bao, a Lightweight Static Partitioning Hypervisor
+#
+# Copyright (c) Bao Project (www.bao-project.org), 2019-
+#
+# Bao is free software; you can redistribute it and/or modify it under the
+# terms of the GNU General Public License version 2 as published by the Free
+# Software Foundation, with a special exception exempting guest code from such
+# license. See the COPYING file in the top-level directory for details.
+#
+
+"""
+Decodes a dump of the hypervisor's trace region (see src/core/inc/trace.h)
+into the Chrome trace event JSON format, which Perfetto and chrome://tracing
+open. Each cpu's ring becomes a thread. Vm exits are paired with the next
+entry on the same cpu into duration events. All other events are instants.
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+TRACE_MAGIC = 0x45434152544f4142
+
+RING_HDR = struct.Struct("<8Q")
+REC = struct.Struct("<4Q")
+
+EVENTS = [
+    "vm exit",
+    "vm entry",
+    "irq inject",
+    "lr refill",
+    "lr spill",
+    "msg send",
+    "msg recv",
+    "ipc hypercall",
+]
+VM_EXIT, VM_ENTRY = 0, 1
+EXIT_TYPES = ["sync", "irq"]
+
+
+def read_rings(data):
+    off = 0
+    while off + RING_HDR.size <= len(data):
+        magic, cpu, rec_num, freq, head = RING_HDR.unpack_from(data, off)[:5]
+        if magic != TRACE_MAGIC or rec_num == 0:
+            break
+        recs_off = off + RING_HDR.size
+        first = max(0, head - rec_num)
+        recs = []
+        for pos in range(first, head):
+            idx = recs_off + (pos % rec_num) * REC.size
+            recs.append(REC.unpack_from(data, idx))
+        yield cpu, freq, recs
+        off = recs_off + rec_num * REC.size
+
+
+def args_of(event, arg0, arg1):
+    if event == 2:
+        return {"id": arg0, "source": arg1}
+    if event in (3, 4):
+        return {"id": arg0, "lr": arg1}
+    if event in (5, 6):
+        args = {"handler": arg1 >> 32, "event": arg1 & 0xffffffff}
+        args["mask" if event == 5 else "data"] = hex(arg0)
+        return args
+    if event == 7:
+        return {"ipc": arg0, "event": arg1}
+    return {"arg0": arg0, "arg1": arg1}
+
+
+def decode(data):
+    out = []
+    for cpu, freq, recs in read_rings(data):
+        out.append({"ph": "M", "pid": 0, "tid": cpu, "name": "thread_name",
+                    "args": {"name": "cpu %d" % cpu}})
+        exit_rec = None
+        for ts, event, arg0, arg1 in sorted(recs):
+            us = ts * 1e6 / freq
+            if event == VM_EXIT:
+                exit_rec = (us, arg0, arg1)
+            elif event == VM_ENTRY:
+                if exit_rec is not None:
+                    start, kind, cause = exit_rec
+                    name = "exit %s" % EXIT_TYPES[kind] \
+                        if kind < len(EXIT_TYPES) else "exit"
+                    out.append({"ph": "X", "pid": 0, "tid": cpu,
+                                "name": name, "ts": start, "dur": us - start,
+                                "args": {"cause": hex(cause)}})
+                exit_rec = None
+            else:
+                name = EVENTS[event] if event < len(EVENTS) else str(event)
+                out.append({"ph": "i", "s": "t", "pid": 0, "tid": cpu,
+                            "name": name, "ts": us,
+                            "args": args_of(event, arg0, arg1)})
+    return {"traceEvents": out, "displayTimeUnit": "ns"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip())
+    parser.add_argument("dump", help="raw dump of the trace region")
+    parser.add_argument("-o", "--output", help="output file (default stdout)")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as f:
+        trace = decode(f.read())
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    json.dump(trace, out)
+    if out is not sys.stdout:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()